@@ -31,6 +31,7 @@
 #include <signal.h>
 
 #include <time.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -46,115 +47,416 @@
 #include "housedepositor.h"
 
 #include "housewiz_device.h"
+#include "housewiz_hash.h"
+#include "housewiz_json.h"
+#include "housewiz_group.h"
+#include "housewiz_store.h"
+#include "housewiz_status.h"
+#include "housewiz_metrics.h"
+#include "housewiz_event.h"
 
 static int use_houseportal = 0;
+static time_t StartTime = 0;
+
+// The automatic save of the configuration is delayed until no new device
+// was detected for a few seconds, but never more than the maximum delay.
+// This coalesces the saves when many devices are detected in a row.
+// The delays are in seconds, the times are monotonic milliseconds.
+//
+static int SaveDelay = 5;
+static int SaveMaxDelay = 30;
+static long long SavePendingSince = 0;
+static long long SaveLastChange = 0;
+
+// Remember what was last sent to the depot, to recognize our own update
+// when it comes back.
+//
+static unsigned int PublishedHash = 0;
+static int PublishedLength = -1;
+
+static void housewiz_publish (const char *data, int length) {
+    PublishedHash = housewiz_hash (data, length);
+    PublishedLength = length;
+    housedepositor_put ("config", housewiz_store_name(), data, length);
+}
+
+// Support for conditional GET: the entity tag is made of the start time
+// (in case of a restart) and of a generation number. Return 1 if the
+// client already has that version, in which case the response is 304.
+//
+static int housewiz_not_modified (long generation) {
+    static char etag[64];
+    snprintf (etag, sizeof(etag), "\"%ld-%ld\"", (long)StartTime, generation);
+    echttp_attribute_set ("ETag", etag);
+    echttp_attribute_set ("Cache-Control", "no-cache");
+
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && strstr (match, etag)) {
+        echttp_error (304, "Not Modified");
+        return 1;
+    }
+    return 0;
+}
 
 static const char *housewiz_status (const char *method, const char *uri,
                                     const char *data, int length) {
-    static char buffer[65537];
-    ParserToken token[1024];
-    char pool[65537];
-    int count = housewiz_device_count();
-    int i;
+    const char *error;
+    const char *status = housewiz_status_export (time(0), &error);
+    if (!status) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return status;
+}
 
-    ParserContext context = echttp_json_start (token, 1024, pool, sizeof(pool));
-
-    int root = echttp_json_add_object (context, 0, 0);
-    echttp_json_add_string (context, root, "host", houselog_host());
-    echttp_json_add_string (context, root, "proxy", houseportal_server());
-    echttp_json_add_integer (context, root, "timestamp", (long)time(0));
-    int top = echttp_json_add_object (context, root, "control");
-    int container = echttp_json_add_object (context, top, "status");
-
-    for (i = 0; i < count; ++i) {
-        time_t pulsed = housewiz_device_deadline(i);
-        const char *name = housewiz_device_name(i);
-        const char *status = housewiz_device_failure(i);
-        if (!status) status = housewiz_device_get(i)?"on":"off";
-        const char *commanded = housewiz_device_commanded(i)?"on":"off";
-
-        int point = echttp_json_add_object (context, container, name);
-        echttp_json_add_string (context, point, "state", status);
-        echttp_json_add_string (context, point, "command", commanded);
-        if (pulsed)
-            echttp_json_add_integer (context, point, "pulse", (int)pulsed);
-        echttp_json_add_string (context, point, "gear", "light");
+static const char *housewiz_status_delta (long since) {
+    const char *error;
+    const char *status = housewiz_status_changes (since, &error);
+    if (!status) {
+        echttp_error (500, error);
+        return "";
     }
-    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
-    if (error) {
+    echttp_content_type_json ();
+    return status;
+}
+
+static const char *housewiz_status_get (const char *method, const char *uri,
+                                        const char *data, int length) {
+
+    long generation = housewiz_device_generation();
+    if (housewiz_not_modified (generation)) return "";
+
+    long long start = housewiz_metrics_start ();
+    const char *result;
+    const char *since = echttp_parameter_get("since");
+    const char *epoch = echttp_parameter_get("epoch");
+    if (since && epoch &&
+        housewiz_device_delta_valid ((time_t)atoll(epoch), atol(since)))
+        result = housewiz_status_delta (atol(since));
+    else
+        result = housewiz_status (method, uri, data, length);
+    housewiz_metrics_stop (WIZ_PROBE_STATUS, start);
+    return result;
+}
+
+// The size of the metrics depends on the number of devices, so the
+// buffers are allocated as needed: the text buffer here, and the JSON
+// writer grows its own. The Prometheus text format is returned
+// when requested explicitly, or when the client accepts plain text.
+//
+static char *MetricsBuffer = 0;
+static int MetricsSize = 0;
+
+static int housewiz_metrics_room (int needed) {
+    if (needed <= MetricsSize) return 1;
+    char *buffer = realloc (MetricsBuffer, needed);
+    if (!buffer) return 0;
+    MetricsBuffer = buffer;
+    MetricsSize = needed;
+    return 1;
+}
+
+static const char *housewiz_metrics_prometheus (void) {
+
+    int length = housewiz_device_metrics_text (MetricsBuffer, MetricsSize);
+    if (length < MetricsSize)
+        length += housewiz_metrics_profile_text (MetricsBuffer + length,
+                                                 MetricsSize - length);
+    else
+        length += housewiz_metrics_profile_text (0, 0);
+
+    if (length >= MetricsSize) {
+        if (!housewiz_metrics_room (length + 1)) {
+            echttp_error (500, "no more memory");
+            return "";
+        }
+        length = housewiz_device_metrics_text (MetricsBuffer, MetricsSize);
+        housewiz_metrics_profile_text (MetricsBuffer + length,
+                                       MetricsSize - length);
+    }
+    echttp_content_type_set ("text/plain; version=0.0.4");
+    return MetricsBuffer;
+}
+
+// The recent device events, including the ones that were not logged
+// because repeated too often.
+//
+static const char *housewiz_recent (const char *method, const char *uri,
+                                    const char *data, int length) {
+    const char *error;
+    const char *since = echttp_parameter_get("since");
+    const char *recent =
+        housewiz_event_recent (since ? atol(since) : 0, &error);
+    if (!recent) {
         echttp_error (500, error);
         return "";
     }
     echttp_content_type_json ();
-    return buffer;
+    return recent;
 }
 
-static const char *housewiz_set (const char *method, const char *uri,
-                                 const char *data, int length) {
+static const char *housewiz_metrics (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    const char *profile = echttp_parameter_get("profile");
+    if (profile) {
+        if (!strcmp (profile, "on")) housewiz_metrics_profile (1);
+        else if (!strcmp (profile, "off")) housewiz_metrics_profile (0);
+        else {
+            echttp_error (400, "invalid profile value");
+            return "";
+        }
+    }
+
+    const char *format = echttp_parameter_get("format");
+    if (format) {
+        if (!strcmp (format, "prometheus")) return housewiz_metrics_prometheus ();
+        if (strcmp (format, "json")) {
+            echttp_error (400, "invalid format");
+            return "";
+        }
+    } else {
+        const char *accept = echttp_attribute_get ("Accept");
+        if (accept && strstr (accept, "text/plain") &&
+            (!strstr (accept, "application/json")))
+            return housewiz_metrics_prometheus ();
+    }
+
+    static struct WizJson json;
+    const char *error;
+
+    housewiz_json_start (&json);
+    housewiz_json_object (&json, 0);
+    housewiz_json_string (&json, "host", houselog_host());
+    housewiz_json_integer (&json, "timestamp", (long long)time(0));
+    housewiz_json_object (&json, "metrics");
+    housewiz_device_metrics_json (&json);
+    housewiz_metrics_profile_json (&json);
+    housewiz_json_end (&json);
+    housewiz_json_end (&json);
+
+    const char *metrics = housewiz_json_export (&json, &error);
+    if (!metrics) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return metrics;
+}
+
+// Apply the state to each point in a comma-separated list of names.
+// When check is set, only verify that all names are valid. Return the
+// number of points found, or -1 if any name is unknown or if there is
+// no name at all.
+//
+// Each name in the list is either a device or a group of devices. A group
+// is a valid name even if none of its members is a known device (yet),
+// and then adds no point.
+//
+static int housewiz_set_list (const char *list, const struct WizPilot *pilot,
+                              int pulse, int check) {
+
+    char name[64];
+    int matched = 0; // Names, since a group may have no known member.
+    int found = 0;
+    int i;
+
+    while (*list) {
+        const char *sep = strchr (list, ',');
+        int length = sep ? sep - list : strlen(list);
+        if (length > 0) {
+            if (length >= sizeof(name)) return -1;
+            memcpy (name, list, length);
+            name[length] = 0;
+            int device = housewiz_device_find (name);
+            if (device >= 0) {
+                if (!check) housewiz_device_pilot (device, pilot, pulse);
+                found += 1;
+                matched += 1;
+            } else {
+                const int *members;
+                int group = housewiz_group_find (name);
+                if (group < 0) return -1;
+                int count = housewiz_group_members (group, &members);
+                if (!check) {
+                    for (i = 0; i < count; ++i)
+                        housewiz_device_pilot (members[i], pilot, pulse);
+                }
+                found += count;
+                matched += 1;
+            }
+        }
+        if (!sep) break;
+        list = sep + 1;
+    }
+    return matched ? found : -1;
+}
+
+static int housewiz_set_integer (const char *name, int *value) {
+    const char *text = echttp_parameter_get(name);
+    if (!text) return 0;
+    *value = atoi(text);
+    return 1;
+}
+
+static int housewiz_set_color (const char *text, struct WizPilot *pilot) {
+    if (*text == '#') text += 1;
+    if (strlen(text) != 6) return 0;
+    if (strspn (text, "0123456789abcdefABCDEF") != 6) return 0;
+    long rgb = strtol (text, 0, 16);
+    pilot->red = (rgb >> 16) & 0xff;
+    pilot->green = (rgb >> 8) & 0xff;
+    pilot->blue = rgb & 0xff;
+    pilot->color = 1;
+    return 1;
+}
+
+// Decode and execute a /wiz/set request. Return 0 on error, after the
+// error status was set.
+//
+static int housewiz_set_apply (void) {
 
     const char *point = echttp_parameter_get("point");
     const char *statep = echttp_parameter_get("state");
     const char *pulsep = echttp_parameter_get("pulse");
-    int state;
+    const char *colorp = echttp_parameter_get("color");
+    struct WizPilot pilot;
     int pulse;
     int i;
-    int count = housewiz_device_count();
-    int found = 0;
 
     if (!point) {
         echttp_error (404, "missing point name");
-        return "";
+        return 0;
     }
-    if (!statep) {
-        echttp_error (400, "missing state value");
-        return "";
+
+    memset (&pilot, 0, sizeof(pilot));
+    int extended = housewiz_set_integer ("dimming", &pilot.dimming);
+    extended |= housewiz_set_integer ("temp", &pilot.temp);
+    extended |= housewiz_set_integer ("scene", &pilot.scene);
+    if (colorp) {
+        if (!housewiz_set_color (colorp, &pilot)) {
+            echttp_error (400, "invalid color value");
+            return 0;
+        }
+        extended = 1;
     }
-    if ((strcmp(statep, "on") == 0) || (strcmp(statep, "1") == 0)) {
-        state = 1;
+    const char *error = housewiz_device_pilot_check (&pilot);
+    if (error) {
+        echttp_error (400, error);
+        return 0;
+    }
+
+    if (!statep) {
+        if (!extended) {
+            echttp_error (400, "missing state value");
+            return 0;
+        }
+        pilot.state = 1; // Changing the light implies turning it on.
+    } else if ((strcmp(statep, "on") == 0) || (strcmp(statep, "1") == 0)) {
+        pilot.state = 1;
     } else if ((strcmp(statep, "off") == 0) || (strcmp(statep, "0") == 0)) {
-        state = 0;
+        pilot.state = 0;
     } else {
         echttp_error (400, "invalid state value");
-        return "";
+        return 0;
     }
 
     pulse = pulsep ? atoi(pulsep) : 0;
     if (pulse < 0) {
         echttp_error (400, "invalid pulse value");
-        return "";
+        return 0;
     }
 
-    for (i = 0; i < count; ++i) {
-       if ((strcmp (point, "all") == 0) ||
-           (strcmp (point, housewiz_device_name(i)) == 0)) {
-           found = 1;
-           housewiz_device_set (i, state, pulse);
-       }
+    if (strcmp (point, "all") == 0) {
+        int count = housewiz_device_count();
+        if (count <= 0) {
+            echttp_error (404, "invalid point name");
+            return 0;
+        }
+        for (i = 0; i < count; ++i) housewiz_device_pilot (i, &pilot, pulse);
+    } else {
+        // Validate the whole list first, so that the request is either
+        // executed as a whole or rejected as a whole.
+        //
+        if (housewiz_set_list (point, &pilot, pulse, 1) < 0) {
+            echttp_error (404, "invalid point name");
+            return 0;
+        }
+        housewiz_set_list (point, &pilot, pulse, 0);
     }
+    return 1;
+}
 
-    if (! found) {
-        echttp_error (404, "invalid point name");
+static const char *housewiz_set (const char *method, const char *uri,
+                                 const char *data, int length) {
+
+    long long start = housewiz_metrics_start ();
+    int ok = housewiz_set_apply ();
+    housewiz_metrics_stop (WIZ_PROBE_SET, start);
+    if (!ok) return "";
+    return housewiz_status (method, uri, data, length);
+}
+
+// The configuration is applied later, by the store worker: the client
+// gets a request number, and polls /wiz/stored until the outcome is known.
+//
+static const char *housewiz_stored_json (long request) {
+
+    static struct WizJson json;
+    const char *error;
+    const char *outcome = housewiz_store_outcome (request, &error);
+
+    housewiz_json_start (&json);
+    housewiz_json_object (&json, 0);
+    housewiz_json_integer (&json, "request", request);
+    housewiz_json_string (&json, "state", outcome);
+    if (error) housewiz_json_string (&json, "error", error);
+    housewiz_json_end (&json);
+    const char *result = housewiz_json_export (&json, &error);
+    if (!result) {
+        echttp_error (500, error);
         return "";
     }
-    return housewiz_status (method, uri, data, length);
+    echttp_content_type_json ();
+    return result;
+}
+
+static const char *housewiz_stored (const char *method, const char *uri,
+                                    const char *data, int length) {
+    const char *request = echttp_parameter_get("request");
+    if (!request) {
+        echttp_error (400, "missing request number");
+        return "";
+    }
+    return housewiz_stored_json (atol(request));
 }
 
 static const char *housewiz_config (const char *method, const char *uri,
                                   const char *data, int length) {
 
     if (strcmp ("GET", method) == 0) {
-        static char buffer[65537];
-        housewiz_device_live_config (buffer, sizeof(buffer));
+        const char *error;
+        if (housewiz_not_modified (housewiz_device_config_generation()))
+            return "";
+        const char *config = housewiz_device_live_config (&error);
+        if (!config) {
+            echttp_error (500, error);
+            return "";
+        }
         echttp_content_type_json ();
-        return buffer;
+        return config;
     } else if (strcmp ("POST", method) == 0) {
-        const char *error = houseconfig_update(data);
+        const char *error =
+            housewiz_store_submit (data, length,
+                                   WIZ_STORE_REFRESH | WIZ_STORE_PUBLISH,
+                                   "AFTER USER CHANGE");
         if (error) {
             echttp_error (400, error);
         } else {
-            housewiz_device_refresh("AFTER USER CHANGE");
-            houselog_event ("SYSTEM", "CONFIG", "SAVE", "TO DEPOT %s", houseconfig_name());
-            housedepositor_put ("config", houseconfig_name(), data, length);
+            houselog_event ("SYSTEM", "CONFIG", "SAVE", "TO DEPOT %s", housewiz_store_name());
+            SavePendingSince = 0; // The user's change supersedes.
+            return housewiz_stored_json (housewiz_store_request());
         }
     } else {
         echttp_error (400, "invalid method");
@@ -164,40 +466,73 @@ static const char *housewiz_config (const char *method, const char *uri,
 
 static void housewiz_background (int fd, int mode) {
 
-    time_t now = time(0);
+    time_t now = time(0); // For the house libraries only.
+    long long monotonic = housewiz_metrics_now ();
+    long long start = housewiz_metrics_start ();
 
     if (use_houseportal) {
-        static time_t LastRenewal = 0;
-        if (now >= LastRenewal + 60) {
+        static long long LastRenewal = 0;
+        if ((!LastRenewal) || (monotonic >= LastRenewal + 60000)) {
             if (LastRenewal > 0) {
                 houseportal_renew();
             } else {
                 static const char *path[] = {"control:/wiz"};
                 houseportal_register (echttp_port(4), path, 1);
             }
-            LastRenewal = now;
+            LastRenewal = monotonic;
         }
     }
-    housewiz_device_periodic(now);
+    long long periodic = housewiz_metrics_start ();
+    housewiz_device_periodic(monotonic);
+    housewiz_metrics_stop (WIZ_PROBE_PERIODIC, periodic);
     if (housewiz_device_changed()) {
-        static char buffer[65537];
-        housewiz_device_live_config (buffer, sizeof(buffer));
-        houseconfig_update(buffer);
-        houselog_event ("SYSTEM", "CONFIG", "SAVE", "TO DEPOT %s (AUTODETECT)", houseconfig_name());
-        housedepositor_put ("config", houseconfig_name(), buffer, strlen(buffer));
-        if (echttp_isdebug()) fprintf (stderr, "Configuration saved\n");
+        if (!SavePendingSince) SavePendingSince = monotonic;
+        SaveLastChange = monotonic;
+    }
+    if (SavePendingSince &&
+        ((monotonic >= SaveLastChange + 1000LL * SaveDelay) ||
+         (monotonic >= SavePendingSince + 1000LL * SaveMaxDelay))) {
+        const char *error;
+        long long autosave = housewiz_metrics_start ();
+        SavePendingSince = 0;
+        const char *config = housewiz_device_live_config (&error);
+        if (config) {
+            houselog_event ("SYSTEM", "CONFIG", "SAVE", "TO DEPOT %s (AUTODETECT)", housewiz_store_name());
+            housewiz_store_submit (config, strlen(config),
+                                   WIZ_STORE_PUBLISH, "AUTODETECT");
+        } else {
+            houselog_trace (HOUSE_FAILURE, "CONFIG", "cannot save: %s", error);
+        }
+        housewiz_metrics_stop (WIZ_PROBE_AUTOSAVE, autosave);
     }
     housediscover (now);
     houselog_background (now);
     housedepositor_periodic (now);
+    housewiz_metrics_stop (WIZ_PROBE_BACKGROUND, start);
 }
 
 static void housewiz_config_listener (const char *name, time_t timestamp,
                                       const char *data, int length) {
 
+    if ((length == PublishedLength) &&
+        (housewiz_hash (data, length) == PublishedHash)) {
+        if (echttp_isdebug())
+            fprintf (stderr, "Ignoring depot update %s: our own\n", name);
+        return;
+    }
     houselog_event ("SYSTEM", "CONFIG", "LOAD", "FROM DEPOT %s", name);
-    if (!houseconfig_update (data))
-        housewiz_device_refresh("AFTER DEPOT UPDATE");
+    housewiz_store_submit (data, length, WIZ_STORE_REFRESH, "AFTER DEPOT UPDATE");
+}
+
+// Called once the new configuration was stored. The configuration is
+// stable while this runs.
+//
+static void housewiz_config_stored (const char *reason,
+                                    const char *data, int length, int flags) {
+
+    if (flags & WIZ_STORE_REFRESH) housewiz_device_refresh (reason);
+    if (flags & WIZ_STORE_PUBLISH) housewiz_publish (data, length);
+    if (echttp_isdebug()) fprintf (stderr, "Configuration saved (%s)\n", reason);
 }
 
 static void housewiz_protect (const char *method, const char *uri) {
@@ -206,7 +541,9 @@ static void housewiz_protect (const char *method, const char *uri) {
 
 int main (int argc, const char **argv) {
 
+    int i;
     const char *error;
+    const char *value;
 
     // These strange statements are to make sure that fds 0 to 2 are
     // reserved, since this application might output some errors.
@@ -216,6 +553,7 @@ int main (int argc, const char **argv) {
     dup(open ("/dev/null", O_WRONLY));
 
     signal(SIGPIPE, SIG_IGN);
+    StartTime = time(0);
 
     echttp_default ("-http-service=dynamic");
 
@@ -227,6 +565,15 @@ int main (int argc, const char **argv) {
     housediscover_initialize (argc, argv);
     houselog_initialize ("wiz", argc, argv);
     housedepositor_initialize (argc, argv);
+    housewiz_metrics_initialize (argc, argv);
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-wiz-save-delay=", argv[i], &value)) {
+            SaveDelay = atoi(value);
+        } else if (echttp_option_match ("-wiz-save-max=", argv[i], &value)) {
+            SaveMaxDelay = atoi(value);
+        }
+    }
 
     houseconfig_default ("--config=wiz");
     error = houseconfig_load (argc, argv);
@@ -240,15 +587,19 @@ int main (int argc, const char **argv) {
             (HOUSE_FAILURE, "PLUG", "Cannot initialize: %s\n", error);
         exit(1);
     }
-    housedepositor_subscribe ("config", houseconfig_name(), housewiz_config_listener);
+    housewiz_store_initialize (housewiz_config_stored);
+    housedepositor_subscribe ("config", housewiz_store_name(), housewiz_config_listener);
 
     echttp_cors_allow_method("GET");
     echttp_protect (0, housewiz_protect);
 
-    echttp_route_uri ("/wiz/status", housewiz_status);
+    echttp_route_uri ("/wiz/status", housewiz_status_get);
     echttp_route_uri ("/wiz/set",    housewiz_set);
+    echttp_route_uri ("/wiz/metrics", housewiz_metrics);
+    echttp_route_uri ("/wiz/recent", housewiz_recent);
 
     echttp_route_uri ("/wiz/config", housewiz_config);
+    echttp_route_uri ("/wiz/stored", housewiz_stored);
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&housewiz_background);
@@ -0,0 +1,239 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_bench.c - Micro-benchmarks of the housewiz hot paths.
+ *
+ * SYNOPSYS:
+ *
+ * housewiz_bench [-time=MS]
+ *
+ * Measure the time and memory allocations per operation for:
+ * - decoding the messages received from the devices,
+ * - building the status and the live configuration,
+ * - refreshing the devices after a configuration change.
+ *
+ * The "status (after change)" benchmark includes changing the state of
+ * one device, which forces the status to be rebuilt.
+ *
+ * Each benchmark runs for at least the specified time (default 500ms).
+ * The inputs are fixed, so that the results are repeatable. The memory
+ * allocations are counted by intercepting the C library's allocator.
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houseconfig.h"
+#include "houselog.h"
+
+#include "housewiz_device.h"
+#include "housewiz_decode.h"
+#include "housewiz_status.h"
+
+static long long BenchTime = 500000000LL; // Nanoseconds.
+
+static unsigned long BenchAllocations = 0;
+
+// Count all allocations, including the ones from the libraries.
+//
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *data, size_t size);
+
+void *malloc (size_t size) {
+    BenchAllocations += 1;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size) {
+    BenchAllocations += 1;
+    return __libc_calloc (count, size);
+}
+
+void *realloc (void *data, size_t size) {
+    BenchAllocations += 1;
+    return __libc_realloc (data, size);
+}
+
+
+static long long housewiz_bench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+typedef const char *housewiz_bench_operation (int iteration);
+
+static void housewiz_bench_run (const char *name, int items,
+                                housewiz_bench_operation *operation) {
+
+    long long iterations = 0;
+    const char *error = operation (0); // Warm up.
+    if (error) {
+        printf ("%-28s %6d  error: %s\n", name, items, error);
+        return;
+    }
+
+    unsigned long allocations = BenchAllocations;
+    long long start = housewiz_bench_now ();
+    long long elapsed;
+    do {
+        int i;
+        for (i = 0; i < 16; ++i) operation (iterations++);
+        elapsed = housewiz_bench_now () - start;
+    } while (elapsed < BenchTime);
+    allocations = BenchAllocations - allocations;
+
+    printf ("%-28s %6d  %12.0f ns/op  %8.2f allocs/op\n", name, items,
+            (double)elapsed / iterations, (double)allocations / iterations);
+}
+
+// Recorded device messages. Most are handled by the fast decoder, the
+// last ones by the generic (fallback) decoder.
+//
+static const char *BenchMessages[] = {
+    "{\"method\":\"syncPilot\",\"env\":\"pro\",\"params\":{\"mac\":\"a8bb50d2e1f3\",\"rssi\":-62,\"src\":\"udp\",\"state\":true,\"sceneId\":0,\"temp\":2700,\"dimming\":100}}",
+    "{\"method\":\"syncPilot\",\"env\":\"pro\",\"params\":{\"mac\":\"a8bb50d2e1f4\",\"rssi\":-71,\"src\":\"\",\"state\":false,\"sceneId\":11,\"dimming\":45}}",
+    "{\"method\":\"syncPilot\",\"env\":\"pro\",\"params\":{\"mac\":\"444f8e1a2b3c\",\"rssi\":-55,\"src\":\"udp\",\"state\":true,\"sceneId\":0,\"r\":255,\"g\":120,\"b\":0,\"c\":0,\"w\":0,\"dimming\":80}}",
+    "{\"method\":\"firstBeat\",\"env\":\"pro\",\"params\":{\"mac\":\"a8bb50d2e1f3\",\"homeId\":1234567,\"fwVersion\":\"1.22.0\"}}",
+    "{\"method\":\"registration\",\"env\":\"pro\",\"result\":{\"mac\":\"a8bb50d2e1f3\",\"success\":true}}",
+    "{\"method\":\"syncPilot\",\"env\":\"pro\",\"params\":{\"mac\":\"a8bb50d2e1f5\",\"src\":\"app\\\"x\",\"state\":true}}",
+    "{\"params\":{\"mac\":\"a8bb50d2e1f6\",\"state\":false},\"method\":\"syncPilot\"}",
+    0
+};
+static int BenchMessagesCount = 0;
+
+static const char *housewiz_bench_decode (int iteration) {
+    struct WizMessage message;
+    const char *data = BenchMessages[iteration % BenchMessagesCount];
+    return housewiz_decode (data, strlen(data), &message);
+}
+
+static const char *housewiz_bench_config (int count, int variant) {
+
+    static char *buffer = 0;
+    static int size = 0;
+    int needed = 128 + count * 128;
+    int length;
+    int i;
+
+    if (needed > size) {
+        buffer = realloc (buffer, needed);
+        size = needed;
+    }
+    length = snprintf (buffer, size, "{\"wiz\":{\"devices\":[");
+    for (i = 0; i < count; ++i) {
+        // The variant changes one device every 10, as a user would.
+        int renamed = variant && ((i % 10) == 0);
+        length += snprintf (buffer + length, size - length,
+                            "%s{\"name\":\"%s%d\",\"address\":\"a8bb50%06x\","
+                            "\"description\":\"bench device %d\"}",
+                            i ? "," : "", renamed ? "lamp" : "wiz", i + 1,
+                            variant > 1 ? i + count : i, i);
+    }
+    snprintf (buffer + length, size - length, "]}}");
+    return buffer;
+}
+
+static const char *housewiz_bench_load (int count, int variant) {
+    const char *error = houseconfig_update (housewiz_bench_config (count, variant));
+    if (error) return error;
+    return housewiz_device_refresh ("BENCHMARK");
+}
+
+static const char *housewiz_bench_status (int iteration) {
+    const char *error = 0;
+    if (!housewiz_status_export ((time_t)(iteration & 1), &error)) return error;
+    return 0;
+}
+
+// Changing one device forces the status to be rebuilt.
+//
+static const char *housewiz_bench_status_changed (int iteration) {
+    housewiz_device_set (0, iteration & 1, 0);
+    return housewiz_bench_status (iteration);
+}
+
+static const char *housewiz_bench_live_config (int iteration) {
+    const char *error = 0;
+    if (!housewiz_device_live_config (&error)) return error;
+    return 0;
+}
+
+// The refresh benchmarks alternate between two configurations, either
+// with small changes (names), or with a different list of devices.
+//
+static int BenchRefreshVariant = 1;
+
+static const char *housewiz_bench_refresh (int iteration) {
+    const char *error = houseconfig_update
+        (housewiz_bench_config (housewiz_device_count(),
+                                (iteration & 1) ? BenchRefreshVariant : 0));
+    if (error) return error;
+    return housewiz_device_refresh ("BENCHMARK");
+}
+
+static const char *housewiz_bench_parse (int iteration) {
+    return houseconfig_update
+        (housewiz_bench_config (housewiz_device_count(), iteration & 1));
+}
+
+int main (int argc, const char **argv) {
+
+    static const int sizes[] = {10, 100, 1000, 5000, 0};
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-time=", argv[i], &value))
+            BenchTime = atoll(value) * 1000000LL;
+    }
+    for (BenchMessagesCount = 0;
+         BenchMessages[BenchMessagesCount]; ++BenchMessagesCount) ;
+
+    houselog_initialize ("wiz", argc, argv);
+    houseconfig_default ("--config=/tmp/housewiz_bench.json");
+    houseconfig_load (argc, argv); // The file may not exist yet.
+
+    printf ("%-28s %6s\n", "benchmark", "items");
+    housewiz_bench_run ("decode", BenchMessagesCount, housewiz_bench_decode);
+
+    for (i = 0; sizes[i]; ++i) {
+        const char *error = housewiz_bench_load (sizes[i], 0);
+        if (error) {
+            printf ("%-28s %6d  error: %s\n", "load", sizes[i], error);
+            continue;
+        }
+        housewiz_bench_run ("status", sizes[i], housewiz_bench_status);
+        housewiz_bench_run ("status (after change)", sizes[i], housewiz_bench_status_changed);
+        housewiz_bench_run ("config", sizes[i], housewiz_bench_live_config);
+        housewiz_bench_run ("config update (no refresh)", sizes[i], housewiz_bench_parse);
+        BenchRefreshVariant = 1;
+        housewiz_bench_run ("update+refresh (renames)", sizes[i], housewiz_bench_refresh);
+        BenchRefreshVariant = 2;
+        housewiz_bench_run ("update+refresh (new list)", sizes[i], housewiz_bench_refresh);
+    }
+    return 0;
+}
+
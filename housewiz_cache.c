@@ -0,0 +1,269 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_cache.c - Keep the last known state of the devices across restarts.
+ *
+ * SYNOPSYS:
+ *
+ * The state file records the last known IP address, state and firmware
+ * version of each device, by MAC address. It is loaded at startup, so
+ * that the devices can be queried and controlled right away, without
+ * waiting for them to answer a broadcast.
+ *
+ * This file is a cache: it is ignored if missing or not valid, and it is
+ * replaced atomically (written to a temporary file, then renamed). It
+ * is not synced to disk: a crash may lose the latest changes, or leave
+ * an empty file behind, which only means a cold start.
+ *
+ * The file is written by a dedicated thread, so that a slow disk does not
+ * stall the main loop. The entries are copied when submitted, and only
+ * the most recent copy is kept if the writer is still busy. If the thread
+ * cannot be started, the file is written synchronously.
+ *
+ * void housewiz_cache_initialize (int argc, const char **argv);
+ *
+ *    Retrieve the name of the state file (option -wiz-state=PATH, default
+ *    /var/lib/house/wiz.state), and start the writer thread. An empty
+ *    name disables the cache.
+ *
+ * int housewiz_cache_load (housewiz_cache_restore *restore);
+ *
+ *    Call restore for each entry of the state file. Return the number of
+ *    entries that were applied, i.e. for which restore returned 1.
+ *
+ * void housewiz_cache_save (const struct WizCacheEntry *entries, int count);
+ *
+ *    Replace the content of the state file. A failure is reported on the
+ *    next call.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "housewiz_cache.h"
+
+#define WIZ_CACHE_MAGIC   0x5a495753 // "WIZS"
+#define WIZ_CACHE_VERSION 1
+
+struct WizCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t size; // sizeof(struct WizCacheEntry), as written.
+};
+
+static char CachePath[256] = "/var/lib/house/wiz.state";
+static int CacheFailed = 0; // Report a failure to save only once.
+
+// The snapshot waiting for the writer thread, and the outcome of the
+// last write. All protected by CacheLock.
+//
+static pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  CacheWakeup = PTHREAD_COND_INITIALIZER;
+static struct WizCacheEntry *CachePending = 0;
+static int CachePendingCount = 0;
+static char CacheError[160];
+static int CacheErrorSet = 0; // 1: failed, -1: succeeded, 0: no news.
+
+static int CacheThreaded = 0;
+
+static void housewiz_cache_write_file (const struct WizCacheEntry *entries,
+                                       int count, char *error, int size);
+
+static void *housewiz_cache_writer (void *unused) {
+
+    char error[sizeof(CacheError)];
+
+    for (;;) {
+        pthread_mutex_lock (&CacheLock);
+        while (!CachePending)
+            pthread_cond_wait (&CacheWakeup, &CacheLock);
+        struct WizCacheEntry *entries = CachePending;
+        int count = CachePendingCount;
+        CachePending = 0;
+        CachePendingCount = 0;
+        pthread_mutex_unlock (&CacheLock);
+
+        housewiz_cache_write_file (entries, count, error, sizeof(error));
+        free (entries);
+
+        pthread_mutex_lock (&CacheLock);
+        if (error[0]) {
+            snprintf (CacheError, sizeof(CacheError), "%s", error);
+            CacheErrorSet = 1;
+        } else {
+            CacheErrorSet = -1;
+        }
+        pthread_mutex_unlock (&CacheLock);
+    }
+    return 0;
+}
+
+void housewiz_cache_initialize (int argc, const char **argv) {
+    int i;
+    const char *value;
+    pthread_t writer;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-wiz-state=", argv[i], &value))
+            snprintf (CachePath, sizeof(CachePath), "%s", value);
+    }
+    if (!CachePath[0]) return;
+
+    if (pthread_create (&writer, 0, housewiz_cache_writer, 0)) {
+        houselog_trace (HOUSE_FAILURE, "CACHE",
+                        "cannot start the writer thread");
+        return;
+    }
+    pthread_detach (writer);
+    CacheThreaded = 1;
+}
+
+int housewiz_cache_load (housewiz_cache_restore *restore) {
+
+    struct WizCacheHeader header;
+    struct WizCacheEntry entry;
+    struct stat info;
+    int count = 0;
+    int applied = 0;
+
+    if (!CachePath[0]) return 0;
+
+    int fd = open (CachePath, O_RDONLY);
+    if (fd < 0) return 0; // Cold start.
+
+    if ((fstat (fd, &info) < 0) ||
+        (read (fd, &header, sizeof(header)) != sizeof(header)) ||
+        (header.magic != WIZ_CACHE_MAGIC) ||
+        (header.version != WIZ_CACHE_VERSION) ||
+        (header.size != sizeof(entry)) ||
+        (info.st_size != sizeof(header) + (off_t)header.count * sizeof(entry))) {
+        houselog_trace (HOUSE_FAILURE, "CACHE",
+                        "ignoring invalid state file %s", CachePath);
+        close (fd);
+        return 0;
+    }
+    while ((count < header.count) &&
+           (read (fd, &entry, sizeof(entry)) == sizeof(entry))) {
+        entry.firmware[sizeof(entry.firmware)-1] = 0;
+        if (restore (&entry)) applied += 1;
+        count += 1;
+    }
+    close (fd);
+    return applied;
+}
+
+static int housewiz_cache_write (int fd, const void *data, size_t length) {
+    const char *p = (const char *)data;
+    while (length > 0) {
+        ssize_t written = write (fd, p, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += written;
+        length -= written;
+    }
+    return 1;
+}
+
+// Report the outcome of a write, once per failure streak.
+//
+static void housewiz_cache_report (const char *error) {
+    if (!error[0]) {
+        CacheFailed = 0;
+        return;
+    }
+    if (!CacheFailed) houselog_trace (HOUSE_FAILURE, "CACHE", "%s", error);
+    CacheFailed = 1;
+}
+
+static void housewiz_cache_write_file (const struct WizCacheEntry *entries,
+                                       int count, char *error, int size) {
+
+    struct WizCacheHeader header;
+    char temporary[sizeof(CachePath)+8];
+
+    error[0] = 0;
+
+    header.magic = WIZ_CACHE_MAGIC;
+    header.version = WIZ_CACHE_VERSION;
+    header.count = count;
+    header.size = sizeof(struct WizCacheEntry);
+
+    snprintf (temporary, sizeof(temporary), "%s.tmp", CachePath);
+    int fd = open (temporary, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        snprintf (error, size, "cannot create %s: %s",
+                  temporary, strerror(errno));
+        return;
+    }
+    int ok = housewiz_cache_write (fd, &header, sizeof(header)) &&
+             housewiz_cache_write (fd, entries, count * sizeof(entries[0]));
+    if (close (fd) < 0) ok = 0;
+    if ((!ok) || (rename (temporary, CachePath) < 0)) {
+        snprintf (error, size, "cannot write %s: %s",
+                  CachePath, strerror(errno));
+        unlink (temporary);
+    }
+}
+
+void housewiz_cache_save (const struct WizCacheEntry *entries, int count) {
+
+    char error[sizeof(CacheError)];
+
+    if (!CachePath[0]) return;
+
+    if (!CacheThreaded) {
+        housewiz_cache_write_file (entries, count, error, sizeof(error));
+        housewiz_cache_report (error);
+        return;
+    }
+
+    struct WizCacheEntry *snapshot =
+        malloc ((count > 0 ? count : 1) * sizeof(entries[0]));
+    if (!snapshot) return; // The cache may be stale, never wrong.
+    if (count > 0) memcpy (snapshot, entries, count * sizeof(entries[0]));
+
+    pthread_mutex_lock (&CacheLock);
+    free (CachePending); // Replaced by a more recent snapshot.
+    CachePending = snapshot;
+    CachePendingCount = count;
+    int outcome = CacheErrorSet;
+    if (outcome > 0) snprintf (error, sizeof(error), "%s", CacheError);
+    else error[0] = 0;
+    CacheErrorSet = 0;
+    pthread_cond_signal (&CacheWakeup);
+    pthread_mutex_unlock (&CacheLock);
+
+    if (outcome) housewiz_cache_report (error);
+}
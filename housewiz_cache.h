@@ -0,0 +1,37 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_cache.h - Keep the last known state of the devices across restarts.
+ *
+ */
+struct WizCacheEntry {
+    unsigned char mac[6];
+    unsigned char status;
+    unsigned char reserved;
+    struct in_addr address;
+    char firmware[24];
+};
+
+typedef int housewiz_cache_restore (const struct WizCacheEntry *entry);
+
+void housewiz_cache_initialize (int argc, const char **argv);
+
+int  housewiz_cache_load (housewiz_cache_restore *restore);
+void housewiz_cache_save (const struct WizCacheEntry *entries, int count);
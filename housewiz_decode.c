@@ -0,0 +1,339 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_decode.c - Decode the messages received from Wiz devices.
+ *
+ * SYNOPSYS:
+ *
+ * const char *housewiz_decode (const char *data, int length,
+ *                              struct WizMessage *message);
+ *
+ *    Extract the method name, as well as the MAC address, state, light
+ *    settings, signal strength and firmware version parameters, from a
+ *    received message. Return an
+ *    error message, or a null pointer on success. A message with an
+ *    unknown method is not an error: this is reported as WIZ_METHOD_OTHER.
+ *
+ *    The messages received from Wiz devices have a simple, fixed, shape.
+ *    These are decoded in a single pass, without copying the data. The
+ *    string values returned point within the original data and are not
+ *    null-terminated. Any message that does not fit the expected shape
+ *    is decoded by the generic JSON parser, using the message's scratch
+ *    space.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "echttp_json.h"
+
+#include "housewiz_decode.h"
+
+
+static void housewiz_decode_clear (struct WizMessage *message) {
+    message->method = WIZ_METHOD_OTHER;
+    message->mac = 0;
+    message->maclength = 0;
+    message->state = -1;
+    message->dimming = -1;
+    message->temp = -1;
+    message->scene = -1;
+    message->red = -1;
+    message->green = -1;
+    message->blue = -1;
+    message->rssi = 0;
+    message->firmware = 0;
+    message->firmwarelength = 0;
+}
+
+static int housewiz_decode_method (const char *name, int length) {
+    if ((length == 9) && (!memcmp (name, "syncPilot", 9)))
+        return WIZ_METHOD_SYNCPILOT;
+    if ((length == 9) && (!memcmp (name, "firstBeat", 9)))
+        return WIZ_METHOD_FIRSTBEAT;
+    return WIZ_METHOD_OTHER;
+}
+
+static int housewiz_decode_is (const char *name, int length,
+                               const char *reference, int size) {
+    return (length == size) && (!memcmp (name, reference, size));
+}
+
+#define IS(p,l,s) housewiz_decode_is (p, l, s, sizeof(s)-1)
+
+// The fast path. Each function returns the position after the part
+// decoded, or a null pointer if the data does not have the expected shape.
+//
+static const char *housewiz_decode_space (const char *p, const char *end) {
+    while ((p < end) &&
+           ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r'))) p++;
+    return p;
+}
+
+static const char *housewiz_decode_string (const char *p, const char *end,
+                                           const char **value, int *length,
+                                           int *escaped) {
+    *escaped = 0;
+    if ((p >= end) || (*p != '"')) return 0;
+    const char *start = ++p;
+    while (p < end) {
+        if (*p == '"') {
+            *value = start;
+            *length = p - start;
+            return p + 1;
+        }
+        if (*p == '\\') {
+            *escaped = 1;
+            p += 1;
+        }
+        p += 1;
+    }
+    return 0;
+}
+
+static const char *housewiz_decode_skip (const char *p, const char *end) {
+    // Skip any value, including nested objects and arrays.
+    int depth = 0;
+    do {
+        const char *value;
+        int length;
+        int escaped;
+        p = housewiz_decode_space (p, end);
+        if (p >= end) return 0;
+        switch (*p) {
+            case '"':
+                p = housewiz_decode_string (p, end, &value, &length, &escaped);
+                if (!p) return 0;
+                break;
+            case '{':
+            case '[':
+                depth += 1;
+                p += 1;
+                break;
+            case '}':
+            case ']':
+                if (--depth < 0) return 0;
+                p += 1;
+                break;
+            case ',':
+            case ':':
+                if (depth <= 0) return 0;
+                p += 1;
+                break;
+            default:
+                // A number or a literal.
+                while ((p < end) && (*p != ',') && (*p != '}') && (*p != ']')
+                       && (*p != ' ') && (*p != '\t') && (*p != '\n')
+                       && (*p != '\r')) p++;
+                break;
+        }
+    } while (depth > 0);
+    return p;
+}
+
+static const char *housewiz_decode_bool (const char *p, const char *end,
+                                         int *value) {
+    if ((end - p >= 4) && (!memcmp (p, "true", 4))) {
+        *value = 1;
+        return p + 4;
+    }
+    if ((end - p >= 5) && (!memcmp (p, "false", 5))) {
+        *value = 0;
+        return p + 5;
+    }
+    return housewiz_decode_skip (p, end); // Not a boolean: ignore.
+}
+
+static const char *housewiz_decode_integer (const char *p, const char *end,
+                                            int *value) {
+    int negative = 0;
+    int result = 0;
+    const char *start;
+    if ((p < end) && (*p == '-')) {
+        negative = 1;
+        p += 1;
+    }
+    for (start = p; (p < end) && (*p >= '0') && (*p <= '9'); ++p)
+        result = result * 10 + (*p - '0');
+    if ((p == start) || ((p < end) && ((*p == '.') || (*p == 'e') || (*p == 'E'))))
+        return housewiz_decode_skip (start, end); // Not an integer: ignore.
+    *value = negative ? -result : result;
+    return p;
+}
+
+// Decode an object. When top is set, this is the top object, otherwise
+// this is the params object.
+//
+static const char *housewiz_decode_object (const char *p, const char *end,
+                                           struct WizMessage *message,
+                                           int top) {
+    p = housewiz_decode_space (p, end);
+    if ((p >= end) || (*p != '{')) return 0;
+    p = housewiz_decode_space (p+1, end);
+    if ((p < end) && (*p == '}')) return p + 1; // Empty object.
+
+    for (;;) {
+        const char *key;
+        int keylength;
+        int escaped;
+
+        p = housewiz_decode_string (p, end, &key, &keylength, &escaped);
+        if (!p || escaped) return 0;
+        p = housewiz_decode_space (p, end);
+        if ((p >= end) || (*p != ':')) return 0;
+        p = housewiz_decode_space (p+1, end);
+        if (p >= end) return 0;
+
+        if (top && IS(key, keylength, "method")) {
+            const char *name;
+            int length;
+            p = housewiz_decode_string (p, end, &name, &length, &escaped);
+            if (!p || escaped) return 0;
+            message->method = housewiz_decode_method (name, length);
+        } else if (top && IS(key, keylength, "params")) {
+            p = housewiz_decode_object (p, end, message, 0);
+        } else if ((!top) && IS(key, keylength, "mac")) {
+            p = housewiz_decode_string (p, end, &(message->mac),
+                                        &(message->maclength), &escaped);
+            if (escaped) return 0;
+        } else if ((!top) && IS(key, keylength, "state")) {
+            p = housewiz_decode_bool (p, end, &(message->state));
+        } else if ((!top) && IS(key, keylength, "dimming")) {
+            p = housewiz_decode_integer (p, end, &(message->dimming));
+        } else if ((!top) && IS(key, keylength, "temp")) {
+            p = housewiz_decode_integer (p, end, &(message->temp));
+        } else if ((!top) && IS(key, keylength, "sceneId")) {
+            p = housewiz_decode_integer (p, end, &(message->scene));
+        } else if ((!top) && IS(key, keylength, "r")) {
+            p = housewiz_decode_integer (p, end, &(message->red));
+        } else if ((!top) && IS(key, keylength, "g")) {
+            p = housewiz_decode_integer (p, end, &(message->green));
+        } else if ((!top) && IS(key, keylength, "b")) {
+            p = housewiz_decode_integer (p, end, &(message->blue));
+        } else if ((!top) && IS(key, keylength, "rssi")) {
+            p = housewiz_decode_integer (p, end, &(message->rssi));
+        } else if ((!top) && IS(key, keylength, "fwVersion")) {
+            p = housewiz_decode_string (p, end, &(message->firmware),
+                                        &(message->firmwarelength), &escaped);
+            if (escaped) return 0;
+        } else {
+            p = housewiz_decode_skip (p, end);
+        }
+        if (!p) return 0;
+
+        p = housewiz_decode_space (p, end);
+        if (p >= end) return 0;
+        if (*p == '}') return p + 1;
+        if (*p != ',') return 0;
+        p = housewiz_decode_space (p+1, end);
+    }
+}
+
+static int housewiz_decode_fast (const char *data, int length,
+                                 struct WizMessage *message) {
+
+    const char *end = data + length;
+    while ((end > data) && (end[-1] == 0)) end -= 1; // Trailing nulls.
+
+    // The method must be a string, and the MAC address is mandatory
+    // for the methods supported. Let the generic decoder report errors.
+    //
+    message->method = -1; // Detect when the method is missing.
+    const char *p = housewiz_decode_object (data, end, message, 1);
+    if (!p) return 0;
+    if (housewiz_decode_space (p, end) != end) return 0;
+    if (message->method < 0) return 0;
+    if ((message->method != WIZ_METHOD_OTHER) && (!message->mac)) return 0;
+    return 1;
+}
+
+static const char *housewiz_decode_generic (const char *data, int length,
+                                            struct WizMessage *message) {
+
+    ParserToken json[256];
+    int jsoncount = 256;
+
+    // We need to copy to preserve the original data (JSON decoding is
+    // destructive).
+    //
+    if (length >= sizeof(message->scratch))
+        length = sizeof(message->scratch) - 1;
+    memcpy (message->scratch, data, length);
+    message->scratch[length] = 0;
+
+    const char *error = echttp_json_parse (message->scratch, json, &jsoncount);
+    if (error) return error;
+
+    int method = echttp_json_search (json, ".method");
+    if ((method < 0) || (json[method].type != PARSER_STRING))
+        return "no valid method";
+    const char *name = json[method].value.string;
+    message->method = housewiz_decode_method (name, strlen(name));
+    if (message->method == WIZ_METHOD_OTHER) return 0;
+
+    int macaddr = echttp_json_search (json, ".params.mac");
+    if ((macaddr < 0) || (json[macaddr].type != PARSER_STRING))
+        return "no valid MAC address";
+    message->mac = json[macaddr].value.string;
+    message->maclength = strlen(message->mac);
+
+    int state = echttp_json_search (json, ".params.state");
+    if ((state >= 0) && (json[state].type == PARSER_BOOL))
+        message->state = json[state].value.bool;
+
+    static const struct {
+        const char *path;
+        int offset;
+    } integers[] = {
+        {".params.dimming", offsetof(struct WizMessage, dimming)},
+        {".params.temp",    offsetof(struct WizMessage, temp)},
+        {".params.sceneId", offsetof(struct WizMessage, scene)},
+        {".params.r",       offsetof(struct WizMessage, red)},
+        {".params.g",       offsetof(struct WizMessage, green)},
+        {".params.b",       offsetof(struct WizMessage, blue)},
+        {".params.rssi",    offsetof(struct WizMessage, rssi)},
+        {0, 0}
+    };
+    int i;
+    for (i = 0; integers[i].path; ++i) {
+        int value = echttp_json_search (json, integers[i].path);
+        if ((value >= 0) && (json[value].type == PARSER_INTEGER))
+            *((int *)((char *)message + integers[i].offset)) =
+                (int)(json[value].value.integer);
+    }
+
+    int firmware = echttp_json_search (json, ".params.fwVersion");
+    if ((firmware >= 0) && (json[firmware].type == PARSER_STRING)) {
+        message->firmware = json[firmware].value.string;
+        message->firmwarelength = strlen(message->firmware);
+    }
+    return 0;
+}
+
+const char *housewiz_decode (const char *data, int length,
+                             struct WizMessage *message) {
+
+    housewiz_decode_clear (message);
+    if (housewiz_decode_fast (data, length, message)) return 0;
+
+    housewiz_decode_clear (message);
+    return housewiz_decode_generic (data, length, message);
+}
+
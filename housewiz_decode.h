@@ -0,0 +1,49 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_decode.h - Decode the messages received from Wiz devices.
+ *
+ */
+#define WIZ_METHOD_OTHER     0
+#define WIZ_METHOD_SYNCPILOT 1
+#define WIZ_METHOD_FIRSTBEAT 2
+
+#define WIZ_DECODE_SCRATCH 512
+
+struct WizMessage {
+    int method;
+    const char *mac;      // Not null-terminated.
+    int maclength;
+    int state;            // -1 if not present.
+    int dimming;          // The following are -1 if not present.
+    int temp;
+    int scene;
+    int red;
+    int green;
+    int blue;
+    int rssi;             // 0 if not present.
+    const char *firmware; // Not null-terminated.
+    int firmwarelength;
+    char scratch[WIZ_DECODE_SCRATCH]; // Used by the generic decoder only.
+};
+
+const char *housewiz_decode (const char *data, int length,
+                             struct WizMessage *message);
+
@@ -31,15 +31,46 @@
  *    Indicate if the configuration was changed due to discovery, which
  *    means it must be saved.
  *
- * const char *housewiz_device_live_config (char *buffer, int size);
+ * const char *housewiz_device_live_config (const char **error);
  *
  *    Recover the current live config, typically to save it to disk after
- *    a change has been detected.
+ *    a change has been detected. The result is valid until the next call.
+ *    Return a null pointer on error.
  *
  * const char *housewiz_device_refresh (const char *reason);
  *
  *    Re-evaluate the configuration after it changed.
  *
+ * long housewiz_device_generation (void);
+ *
+ *    Return a number that changes every time the state of a device, as
+ *    reported by the web API, changes.
+ *
+ * long housewiz_device_stamp (int point);
+ *
+ *    Return the generation of the last state change of the device.
+ *
+ * time_t housewiz_device_epoch (void);
+ *
+ *    Return the time when the generation numbering started. A generation
+ *    number is only meaningful with the epoch it was issued in.
+ *
+ * int housewiz_device_delta_valid (time_t epoch, long since);
+ *
+ *    Return 1 if the changes since the specified generation are known.
+ *    This is never the case if the generation is from another epoch,
+ *    i.e. was issued before the service restarted.
+ *
+ * const char *housewiz_device_removed (long since, int *cursor);
+ *
+ *    Walk the list of devices removed since the specified generation.
+ *    The cursor must be initialized to 0. Return a null pointer at the
+ *    end of the list.
+ *
+ * long housewiz_device_config_generation (void);
+ *
+ *    Return a number that changes every time the live config changes.
+ *
  * int housewiz_device_count (void);
  *
  *    Return the number of configured devices available.
@@ -48,15 +79,28 @@
  *
  *    Return the name of a wiz device.
  *
+ * int housewiz_device_find (const char *name);
+ *
+ *    Return the index of the named wiz device, or -1 if not found.
+ *
  * const char *housewiz_device_failure (int point);
  *
  *    Return a string describing the failure, or a null pointer if healthy.
+ *    A device restored from the state file is healthy, with its cached
+ *    state, until it has failed to answer for as long as a detected one.
+ *
+ * const struct WizLight *housewiz_device_light (int point);
+ *
+ *    Return the light settings and signal strength last reported by the
+ *    device. A change of the signal strength alone does not change the
+ *    device's generation.
  *
  * int    housewiz_device_commanded (int point);
  * time_t housewiz_device_deadline (int point);
  *
  *    Return the last commanded state, or the command deadline, for
- *    the specified wiz device.
+ *    the specified wiz device. The deadline is a wall clock time, for
+ *    reporting only: all the scheduling uses the monotonic clock.
  *
  * int housewiz_device_get (int point);
  *
@@ -70,23 +114,71 @@
  *
  *    Return 1 on success, 0 if the device is not known and -1 on error.
  *
- * void housewiz_device_periodic (void);
+ * const char *housewiz_device_pilot_check (const struct WizPilot *pilot);
+ * int housewiz_device_pilot (int point, const struct WizPilot *pilot,
+ *                            int pulse);
+ *
+ *    Same as housewiz_device_set(), with optional brightness, color
+ *    temperature, RGB color or scene settings. These settings are ignored
+ *    when the state is off. The check returns an error message if the
+ *    settings are not valid, or a null pointer.
+ *
+ * unsigned long housewiz_device_dropped (void);
+ *
+ *    Return the number of received packets that were lost, either dropped
+ *    by the kernel because the receive buffer overflowed, or truncated.
+ *
+ * void housewiz_device_metrics_json (struct WizJson *json);
+ * int housewiz_device_metrics_text (char *buffer, int size);
+ *
+ *    Report the traffic counters and the command latency histograms, global
+ *    and per device, in JSON or in the Prometheus text format. The latter
+ *    returns the length of the text, which is more than size if the buffer
+ *    was too small.
+ *
+ * void housewiz_device_periodic (long long now);
  *
- *    This function must be called every second. It runs the Wiz device
- *    discovery and ends the expired pulses.
+ *    This function must be called every second, with the monotonic time
+ *    in milliseconds (see housewiz_metrics_now()). It runs the Wiz device
+ *    discovery. The device timers (queries, retries, end of pulses) are
+ *    run from a timer of their own, with millisecond resolution: only
+ *    the devices that have a deadline due are visited.
+ *
+ * The network interfaces are enumerated at startup, and then again only
+ * when the kernel reports a change (rtnetlink link and address events).
+ * If these events are not available, the interfaces are enumerated every
+ * minute.
+ *
+ * With the option -wiz-receive-threads=N, the messages from the devices
+ * are received and decoded by N worker threads (see housewiz_pipeline.c),
+ * and the main loop only applies the decoded updates.
+ *
+ * The discovery uses one socket per network interface, bound to the
+ * interface's address, which broadcasts to that interface's subnet. Each
+ * device is then queried only through the interface that reaches it. The
+ * main socket, bound to any address, receives the other packets and is
+ * used when no interface socket is available (option -wiz-interfaces=none).
  */
 
+#define _GNU_SOURCE // For recvmmsg().
+
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 
 #include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <ifaddrs.h>
 #include <netpacket/packet.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -96,6 +188,16 @@
 #include "houseconfig.h"
 
 #include "housewiz_device.h"
+#include "housewiz_queue.h"
+#include "housewiz_timer.h"
+#include "housewiz_hash.h"
+#include "housewiz_decode.h"
+#include "housewiz_json.h"
+#include "housewiz_metrics.h"
+#include "housewiz_group.h"
+#include "housewiz_pipeline.h"
+#include "housewiz_cache.h"
+#include "housewiz_event.h"
 
 
 // This offset is used to "sign" an ID that contains a device index.
@@ -105,43 +207,208 @@
 //
 #define WIZ_ID_OFFSET 12000
 
-struct DeviceMap {
+// The device information is split in three arrays, according to how
+// often each item is accessed: the device state is scanned each time the
+// status is reported, the timing items are used when exchanging messages
+// with the device, and the configuration items are rarely accessed. This
+// keeps the scans of a large number of devices fast.
+//
+// All times are monotonic, in milliseconds.
+//
+struct DeviceState {
+    long long detected;
+    long long deadline;
+    long changed; // Generation of the last state change.
+    char status;
+    char commanded;
+    struct WizLight light;
+};
+
+struct DeviceTiming {
+    struct sockaddr_in ipaddress;
+    long long pending;      // Milliseconds, when the command is abandoned.
+    long long retry;        // Milliseconds, when the command is repeated.
+    long long reboot;
+    long long next_sense;
+    long long commandstart; // Milliseconds, for measuring the latency.
+    int srtt;     // Smoothed confirmation time (ms), 0 if never measured.
+    int rttvar;   // Its mean deviation (ms).
+    int attempts; // Retries of the ongoing command.
+    int backoff;  // The retry timeout doubles after each command timeout.
+    int network; // Index+1 of the interface that reaches it, 0 if unknown.
+    struct WizPilot pilot; // The last command, repeated on retries.
+    uint64_t fingerprint;  // Of the last syncPilot message, 0 if none.
+    long long restored;    // When loaded from the state file, 0 if not.
+    char firmware[24];
+};
+
+struct DeviceConfig {
     char name[32];
     char macaddress[16];
+    unsigned char mac[6];
+    char macvalid;
     char description[256];
-    struct sockaddr_in ipaddress;
-    time_t detected;
-    int status;
-    int commanded;
-    time_t pending;
-    time_t deadline;
-    time_t reboot;
-    time_t last_sense;
 };
 
 static int DeviceListChanged = 0;
 
-static struct DeviceMap *Devices = 0;
+// The generation is incremented every time the reported state of a
+// device changes, so that the web API can avoid rebuilding its output.
+//
+static long DeviceGeneration = 1;
+static long DeviceConfigGeneration = 1;
+static time_t DeviceEpoch = 0;
+
+// Keep a short history of the devices removed from the configuration, so
+// that a client can be told which points have disappeared. Deltas cannot
+// be calculated from a generation older than the horizon.
+//
+#define DEVICE_REMOVED_MAX 64
+
+static struct {
+    char name[32];
+    long generation;
+} DeviceRemoved[DEVICE_REMOVED_MAX];
+static int DeviceRemovedCount = 0; // Total since startup.
+static long DeviceRemovedHorizon = 0;
+
+static struct DeviceState  *DeviceStates = 0;
+static struct DeviceTiming *DeviceTimings = 0;
+static struct DeviceConfig *DeviceConfigs = 0;
 static int DevicesCount = 0;
 static int DevicesSpace = 0;
 
+// The metrics are kept in a separate array since these are only accessed
+// when something happens, or when reported.
+//
+static struct WizCounters *DeviceCounters = 0;
+static struct WizCounters WizTotals;
+static unsigned long WizParseFailures = 0;
+static unsigned long WizUnknownMethods = 0;
+
+// The MAC address index and the name index are open addressing hash
+// tables that map the binary form of a MAC address, or the device name,
+// to the device index. These are rebuilt when the configuration is
+// refreshed, and extended when a device is added. Devices with a MAC
+// address that is not valid are not included in the MAC index.
+//
+#define DEVICE_INDEX_EMPTY (-1)
+
+static int *DeviceMacIndex = 0;
+static int *DeviceNameIndex = 0;
+static int DeviceIndexSize = 0; // Always a power of 2.
+
+// Map the sender's address to the device, for the heartbeats that are
+// identical to the previous one. This is a direct mapped cache of the
+// same size as the indexes: collisions only cause a full decode.
+//
+static int *DeviceSenderIndex = 0;
+static unsigned long WizHeartbeatsUnchanged = 0;
+
+// Device timing, in milliseconds.
+//
+#define WIZ_SENSE_PERIOD   35000  // Query each device's state this often.
+#define WIZ_SILENT_TIMEOUT 100000 // About 3 queries without an answer.
+
+// Command retries adapt to each device, in the manner of TCP (RFC 6298):
+// the first retry happens after the smoothed confirmation time plus four
+// times its deviation, and the delay doubles after each retry. The command
+// is abandoned when all the retries had their chance. Only the commands
+// that were confirmed without a retry are measured, since the confirmation
+// of a repeated command cannot be matched to a specific send. A command
+// that times out doubles the device's retry timeout, until the next clean
+// measurement (RFC 6298, sections 5.5 and 5.7). All values in milliseconds.
+//
+#define WIZ_RTO_INITIAL    1000 // Until the device's first confirmation.
+#define WIZ_RTO_MIN        150
+#define WIZ_RTO_MAX        8000
+#define WIZ_RETRY_MAX      3
+#define WIZ_BACKOFF_MAX    3 // Doublings of the retry timeout after timeouts.
+#define WIZ_COMMAND_MIN    2000 // Bounds of the time allowed for a command.
+#define WIZ_COMMAND_MAX    20000
+
+// The device queries are spread over time, so that the devices do not
+// answer in bursts. The sense period of each device is randomly adjusted
+// by up to 10%, and the number of queries per second is limited. Each
+// slot in the ring counts the queries scheduled for one second (of the
+// monotonic clock).
+//
+#define WIZ_SENSE_JITTER   (WIZ_SENSE_PERIOD / 10)
+#define WIZ_SENSE_RING     256
+
+static int WizSenseRate = 20;
+
+static struct {
+    long long second;
+    int count;
+} WizSenseSlots[WIZ_SENSE_RING];
+
+// The device timers are run by a timerfd, armed for the earliest one.
+// Without it, these are run from the periodic function, every second.
+//
+static int WizTimer = -1;
+static long long WizTimerArmed = 0; // Zero if not armed.
+
+// The last known address, state and firmware of the devices are saved
+// (see housewiz_cache.c) a few seconds after a change, so that a restart
+// does not wait for the devices to answer a broadcast.
+//
+#define WIZ_CACHE_DELAY 10000 // Milliseconds.
+
+static int WizCacheChanged = 0;
+static long long WizCacheSaved = 0;
+
 static int WizDevicePort = 38899;
 static int WizStatusPort = 38900;
 
 static int WizSocket = -1;
 static struct sockaddr_in WizBroadcast;
 
+// The receive side drains the socket in batches. The receive buffer size
+// can be enlarged, so that the kernel does not drop packets when a large
+// number of devices answer a broadcast at the same time.
+//
+#define WIZ_PACKET_MAX    512
+#define WIZ_RECEIVE_BATCH 64
+
+static int WizReceiveBuffer = 0; // Use the system default.
+static int WizReceivePerWakeup = 4 * WIZ_RECEIVE_BATCH;
 
+static uint32_t WizReceiveDropped = 0; // Reported by the kernel.
+static unsigned long WizReceiveTruncated = 0;
+
+
+// The network interfaces. An entry which name is empty is free. The
+// entries are not moved, so that the devices can refer to them.
+//
 struct NetworkMap {
     char name[32];
     char ip[20];
     char mac[16];
+    struct in_addr address;
+    struct in_addr netmask;
+    struct sockaddr_in broadcast; // The subnet's directed broadcast.
+    int socket;                   // -1 if none.
+    int seen;                     // Found during the last enumeration.
+    uint32_t dropped;             // Reported by the kernel.
+    char registration[128];       // The registration payload, after the id.
+    int registrationlength;
 };
 
 #define NETWORKS_MAX 8
 static struct NetworkMap Networks[NETWORKS_MAX];
 static int NetworksCount = 0;
 
+// The interfaces used, as a comma-separated list of names. An empty list
+// means all, "none" means that no interface socket is opened.
+//
+static char WizInterfaces[256] = "";
+static int WizInterfaceSockets = 1;
+
+static unsigned long WizReceiveDroppedClosed = 0; // From closed sockets.
+
+static int WizNetlink = -1; // Interface change events.
+
 
 static void safecpy (char *dest, const char *src, int limit) {
     strncpy (dest, src, limit-1);
@@ -152,6 +419,55 @@ int housewiz_device_count (void) {
     return DevicesCount;
 }
 
+long housewiz_device_generation (void) {
+    return DeviceGeneration;
+}
+
+long housewiz_device_config_generation (void) {
+    return DeviceConfigGeneration;
+}
+
+static void housewiz_device_touch (int device) {
+    DeviceGeneration += 1;
+    DeviceStates[device].changed = DeviceGeneration;
+}
+
+long housewiz_device_stamp (int point) {
+    if (point < 0 || point >= DevicesCount) return 0;
+    return DeviceStates[point].changed;
+}
+
+time_t housewiz_device_epoch (void) {
+    return DeviceEpoch;
+}
+
+int housewiz_device_delta_valid (time_t epoch, long since) {
+    if (epoch != DeviceEpoch) return 0;
+    return (since >= DeviceRemovedHorizon) && (since <= DeviceGeneration);
+}
+
+const char *housewiz_device_removed (long since, int *cursor) {
+    int first = DeviceRemovedCount - DEVICE_REMOVED_MAX;
+    if (first < 0) first = 0;
+    if (*cursor < first) *cursor = first;
+    while (*cursor < DeviceRemovedCount) {
+        int i = (*cursor)++ % DEVICE_REMOVED_MAX;
+        if (DeviceRemoved[i].generation > since) return DeviceRemoved[i].name;
+    }
+    return 0;
+}
+
+static void housewiz_device_record_removal (const char *name) {
+    int i = DeviceRemovedCount++ % DEVICE_REMOVED_MAX;
+    if (DeviceRemovedCount > DEVICE_REMOVED_MAX) {
+        // The entry being overwritten is lost: deltas are no longer
+        // possible before it was removed.
+        DeviceRemovedHorizon = DeviceRemoved[i].generation;
+    }
+    safecpy (DeviceRemoved[i].name, name, sizeof(DeviceRemoved[i].name));
+    DeviceRemoved[i].generation = DeviceGeneration;
+}
+
 int housewiz_device_changed (void) {
     if (DeviceListChanged) {
         DeviceListChanged = 0;
@@ -162,145 +478,614 @@ int housewiz_device_changed (void) {
 
 const char *housewiz_device_name (int point) {
     if (point < 0 || point >= DevicesCount) return 0;
-    return Devices[point].name;
+    return DeviceConfigs[point].name;
 }
 
 int housewiz_device_commanded (int point) {
     if (point < 0 || point >= DevicesCount) return 0;
-    return Devices[point].commanded;
+    return DeviceStates[point].commanded;
 }
 
 time_t housewiz_device_deadline (int point) {
     if (point < 0 || point >= DevicesCount) return 0;
-    return Devices[point].deadline;
+    long long deadline = DeviceStates[point].deadline;
+    if (!deadline) return 0;
+    return time(0) + (time_t)((deadline - housewiz_metrics_now() + 500) / 1000);
 }
 
+static int housewiz_device_reachable (int i, long long now);
+
 const char *housewiz_device_failure (int point) {
     if (point < 0 || point >= DevicesCount) return 0;
-    if (!Devices[point].detected) return "silent";
+    if (!housewiz_device_reachable (point, housewiz_metrics_now()))
+        return "silent";
     return 0;
 }
 
 int housewiz_device_get (int point) {
     if (point < 0 || point >= DevicesCount) return 0;
-    return Devices[point].status;
+    return DeviceStates[point].status;
 }
 
-static void housewiz_device_socket (void) {
+// When the receive workers are used, these own the status port: the
+// other sockets use any port, and are used to send. The devices answer
+// the queries to these sockets, so these are attached to the workers
+// too, and the main loop only reads them if that failed.
+//
+static int WizReceiveThreads = 0;
 
-    WizBroadcast.sin_family = AF_INET;
-    WizBroadcast.sin_port = htons(WizStatusPort);
-    WizBroadcast.sin_addr.s_addr = INADDR_ANY;
+static void housewiz_device_receive (int fd, int mode);
+
+static void housewiz_device_listen (int fd) {
+    if (WizReceiveThreads && housewiz_pipeline_attach (fd)) return;
+    echttp_listen (fd, 1, housewiz_device_receive, 0);
+}
+
+static int housewiz_device_port (void) {
+    return WizReceiveThreads ? 0 : WizStatusPort;
+}
+
+// Open a UDP socket bound to the status port on the specified local
+// address. A failure is fatal for the main socket only, since a network
+// interface may come and go at any time.
+//
+static int housewiz_device_bind (struct in_addr address, const char *name,
+                                 int port) {
 
-    WizSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (WizSocket < 0) {
+    int critical = (address.s_addr == htonl(INADDR_ANY));
+    struct sockaddr_in local;
+
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr = address;
+
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0) {
         houselog_trace (HOUSE_FAILURE, "DEVICE",
                         "cannot open UDP socket: %s", strerror(errno));
-        exit(1);
+        if (critical) exit(1);
+        return -1;
     }
 
-    if (bind(WizSocket,
-             (struct sockaddr *)(&WizBroadcast),
-             sizeof(WizBroadcast)) < 0) {
+    // The interface sockets share the status port with the main socket.
+    int value = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0)
         houselog_trace (HOUSE_FAILURE, "SOCKET",
-                        "cannot bind to UDP port %d: %s",
-                        WizStatusPort, strerror(errno));
-        exit(1);
+                        "cannot share port %d: %s", port, strerror(errno));
+
+    if (bind(s, (struct sockaddr *)(&local), sizeof(local)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "SOCKET",
+                        "cannot bind to UDP port %d on %s: %s",
+                        port, name, strerror(errno));
+        if (critical) exit(1);
+        close (s);
+        return -1;
     }
 
-    int value = 1;
-    if (setsockopt(WizSocket, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0) {
+    value = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0) {
         houselog_trace (HOUSE_FAILURE, "SOCKET",
-                        "cannot broadcast: %s", strerror(errno));
-        exit(1);
+                        "cannot broadcast on %s: %s", name, strerror(errno));
+        if (critical) exit(1);
+        close (s);
+        return -1;
     }
 
+    // The following options are not critical: report, but continue.
+    //
+    value = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) < 0)
+        houselog_trace (HOUSE_FAILURE, "SOCKET",
+                        "cannot count drops: %s", strerror(errno));
+
+    if (WizReceiveBuffer > 0) {
+        if (setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+                       &WizReceiveBuffer, sizeof(WizReceiveBuffer)) < 0)
+            houselog_trace (HOUSE_FAILURE, "SOCKET",
+                            "cannot set receive buffer to %d: %s",
+                            WizReceiveBuffer, strerror(errno));
+    }
+
+    int flags = fcntl (s, F_GETFL, 0);
+    if ((flags < 0) || (fcntl (s, F_SETFL, flags | O_NONBLOCK) < 0))
+        houselog_trace (HOUSE_FAILURE, "SOCKET",
+                        "cannot set non-blocking mode: %s", strerror(errno));
+
+    houselog_trace (HOUSE_INFO, "DEVICE",
+                    "UDP port %d is now open on %s", port, name);
+    return s;
+}
+
+static void housewiz_device_socket (void) {
+
+    struct in_addr any;
+    any.s_addr = htonl(INADDR_ANY);
+    WizSocket = housewiz_device_bind (any, "any address", housewiz_device_port ());
+
+    WizBroadcast.sin_family = AF_INET;
     WizBroadcast.sin_port = htons(WizDevicePort);
     WizBroadcast.sin_addr.s_addr = INADDR_BROADCAST;
+}
+
+// The key used to merge queued packets: there is at most one control
+// and one sense packet queued for each device (one per network interface
+// when the device's interface is not known).
+//
+#define WIZ_KEY_CONTROL 0
+#define WIZ_KEY_SENSE   1
+#define WIZ_KEY(device,kind) ((((unsigned long)(device)+1) << 4) | (kind))
 
-    houselog_trace (HOUSE_INFO, "DEVICE", "UDP port %d is now open", WizStatusPort);
+// The packets are built from templates: a constant head that ends right
+// before the id, the id digits, and a tail that follows the id. The tail
+// includes the string terminator, which is sent as before.
+//
+#define WIZ_PART_HEAD 0
+#define WIZ_PART_ID   1
+#define WIZ_PART_TAIL 2
+#define WIZ_PARTS     3
+
+static const char WizSetPilotHead[] =
+    "{\"method\": \"setPilot\", \"id\": ";
+static const char WizSetPilotOn[] =
+    ", \"env\":\"pro\", \"params\": {\"state\": true}}";
+static const char WizSetPilotOff[] =
+    ", \"env\":\"pro\", \"params\": {\"state\": false}}";
+
+static const char WizRegistrationHead[] =
+    "{\"method\": \"registration\", \"id\": ";
+
+static int housewiz_device_digits (int id, char *buffer) {
+    char digits[12];
+    int count = 0;
+    int length;
+    do {
+        digits[count++] = '0' + (id % 10);
+        id /= 10;
+    } while (id > 0);
+    for (length = 0; count > 0; ++length) buffer[length] = digits[--count];
+    return length;
 }
 
-static void housewiz_device_send (const struct sockaddr_in *a, const char *d) {
+static void housewiz_device_send (int s, unsigned long key,
+                                  const struct sockaddr_in *a,
+                                  const struct iovec *parts) {
     if ((long)(a->sin_addr.s_addr) == 0) return; // Not detected.
     if (echttp_isdebug()) {
         long ip = ntohl((long)(a->sin_addr.s_addr));
         int port = ntohs(a->sin_port);
-        printf ("Sending packet to %ld.%ld.%ld.%ld(port %d): %s\n",
-                (ip>>24)&0xff, (ip>>16)&0xff, (ip>>8)&0xff, ip&0xff, port, d);
+        printf ("Sending packet to %ld.%ld.%ld.%ld(port %d): %.*s%.*s%s\n",
+                (ip>>24)&0xff, (ip>>16)&0xff, (ip>>8)&0xff, ip&0xff, port,
+                (int)(parts[WIZ_PART_HEAD].iov_len),
+                (const char *)(parts[WIZ_PART_HEAD].iov_base),
+                (int)(parts[WIZ_PART_ID].iov_len),
+                (const char *)(parts[WIZ_PART_ID].iov_base),
+                (const char *)(parts[WIZ_PART_TAIL].iov_base));
     }
-    int sent = sendto (WizSocket, d, strlen(d)+1, 0,
-                       (struct sockaddr *)a, sizeof(struct sockaddr_in));
-    if (sent < 0)
-        houselog_trace
-            (HOUSE_FAILURE, "DEVICE", "sendto() error: %s", strerror(errno));
+    housewiz_queue_submitv (s, key, a, parts, WIZ_PARTS);
 }
 
-static void housewiz_device_sense (const struct sockaddr_in *a, int id) {
+// Return the interface that reaches the specified address, or -1.
+//
+static int housewiz_device_route (const struct sockaddr_in *a) {
     int i;
-    char buffer[256];
+    for (i = 0; i < NetworksCount; i++) {
+        if (!Networks[i].name[0]) continue;
+        if (((a->sin_addr.s_addr ^ Networks[i].address.s_addr)
+                & Networks[i].netmask.s_addr) == 0) return i;
+    }
+    return -1;
+}
+
+// Return the interface that reaches the device, or -1. The result is
+// cached, but checked since the device or the interface may have moved.
+//
+static int housewiz_device_network (int device) {
+    int n = DeviceTimings[device].network - 1;
+    const struct sockaddr_in *a = &(DeviceTimings[device].ipaddress);
+    if ((n >= 0) && Networks[n].name[0] &&
+        (((a->sin_addr.s_addr ^ Networks[n].address.s_addr)
+              & Networks[n].netmask.s_addr) == 0)) return n;
+    n = housewiz_device_route (a);
+    DeviceTimings[device].network = n + 1;
+    return n;
+}
+
+static int housewiz_device_socket_of (int network) {
+    if ((network < 0) || (Networks[network].socket < 0)) return WizSocket;
+    return Networks[network].socket;
+}
+
+// The registration tail is specific to each interface, and is built when
+// the interfaces are enumerated.
+//
+static void housewiz_device_register (int s, int network, unsigned long key,
+                                      const struct sockaddr_in *a, int id) {
+    char digits[12];
+    struct iovec parts[WIZ_PARTS];
+
+    parts[WIZ_PART_HEAD].iov_base = (void *)WizRegistrationHead;
+    parts[WIZ_PART_HEAD].iov_len = sizeof(WizRegistrationHead) - 1;
+    parts[WIZ_PART_ID].iov_base = digits;
+    parts[WIZ_PART_ID].iov_len = housewiz_device_digits (id, digits);
+    parts[WIZ_PART_TAIL].iov_base = Networks[network].registration;
+    parts[WIZ_PART_TAIL].iov_len = Networks[network].registrationlength + 1;
+    housewiz_device_send (s, key, a, parts);
+}
+
+// Query the state of one device, through the interface that reaches it.
+// If that interface is not known, query on behalf of all interfaces.
+//
+static void housewiz_device_sense (int device) {
+    int i;
+    const struct sockaddr_in *a = &(DeviceTimings[device].ipaddress);
     if ((long)(a->sin_addr.s_addr) == 0) return; // Not detected.
+
+    int n = housewiz_device_network (device);
+    if (n >= 0) {
+        housewiz_device_register (housewiz_device_socket_of (n), n,
+                                  WIZ_KEY(device, WIZ_KEY_SENSE+n), a,
+                                  WIZ_ID_OFFSET+device);
+        return;
+    }
+    for (i = 0; i < NetworksCount; i++) {
+        if (!Networks[i].name[0]) continue;
+        housewiz_device_register (WizSocket, i,
+                                  WIZ_KEY(device, WIZ_KEY_SENSE+i), a,
+                                  WIZ_ID_OFFSET+device);
+    }
+}
+
+// Query all devices: broadcast on each interface's subnet, or else use
+// the limited broadcast if there is no interface socket.
+//
+static void housewiz_device_discover (void) {
+    int i;
+    int sent = 0;
     for (i = 0; i < NetworksCount; i++) {
-        snprintf (buffer, sizeof(buffer),
-                  "{\"method\": \"registration\", \"id\": %d, \"params\":"
-                      "{\"phoneIp\": \"%s\", \"register\":true, "
-                      "\"phoneMac\":\"%s\"}}",
-                  id, Networks[i].ip, Networks[i].mac);
-        housewiz_device_send (a, buffer);
+        if (!Networks[i].name[0]) continue;
+        if (Networks[i].socket < 0) continue;
+        housewiz_device_register (Networks[i].socket, i,
+                                  WIZ_KEY(-1, WIZ_KEY_SENSE+i),
+                                  &(Networks[i].broadcast), 1);
+        sent += 1;
+    }
+    if (sent) return;
+
+    for (i = 0; i < NetworksCount; i++) {
+        if (!Networks[i].name[0]) continue;
+        housewiz_device_register (WizSocket, i,
+                                  WIZ_KEY(-1, WIZ_KEY_SENSE+i),
+                                  &WizBroadcast, 1);
+    }
+}
+
+static int housewiz_device_pilot_same (const struct WizPilot *a,
+                                       const struct WizPilot *b) {
+    if ((a->state != b->state) || (a->dimming != b->dimming) ||
+        (a->temp != b->temp) || (a->scene != b->scene) ||
+        (a->color != b->color)) return 0;
+    if (!a->color) return 1;
+    return (a->red == b->red) && (a->green == b->green) && (a->blue == b->blue);
+}
+
+static int housewiz_device_pilot_extended (const struct WizPilot *pilot) {
+    return pilot->state &&
+           (pilot->dimming || pilot->temp || pilot->scene || pilot->color);
+}
+
+// Build the setPilot tail for extended settings. The last tail is kept,
+// since a group command sends the same settings to many devices.
+//
+static const char *housewiz_device_pilot_tail (const struct WizPilot *pilot,
+                                               int *length) {
+    static struct WizPilot last;
+    static char tail[192];
+    static int taillength = 0;
+
+    if (taillength && housewiz_device_pilot_same (pilot, &last)) {
+        *length = taillength;
+        return tail;
     }
+    int l = snprintf (tail, sizeof(tail),
+                      ", \"env\":\"pro\", \"params\": {\"state\": true");
+    if (pilot->dimming)
+        l += snprintf (tail+l, sizeof(tail)-l, ", \"dimming\": %d", pilot->dimming);
+    if (pilot->temp)
+        l += snprintf (tail+l, sizeof(tail)-l, ", \"temp\": %d", pilot->temp);
+    if (pilot->scene)
+        l += snprintf (tail+l, sizeof(tail)-l, ", \"sceneId\": %d", pilot->scene);
+    if (pilot->color)
+        l += snprintf (tail+l, sizeof(tail)-l,
+                       ", \"r\": %d, \"g\": %d, \"b\": %d",
+                       pilot->red, pilot->green, pilot->blue);
+    l += snprintf (tail+l, sizeof(tail)-l, "}}");
+    last = *pilot;
+    taillength = l + 1; // Include the string terminator.
+    *length = taillength;
+    return tail;
 }
 
+// Send the specified state. The extended settings of the last command
+// are sent as well, if that command was to turn the device on.
+//
 static void housewiz_device_control (int device, int state) {
-    char buffer[256];
-    snprintf (buffer, sizeof(buffer),
-          "{\"method\": \"setPilot\", \"id\": %d, \"env\":\"pro\", \"params\": {\"state\": %s}}",
-          WIZ_ID_OFFSET+device, state?"true":"false");
-    housewiz_device_send (&(Devices[device].ipaddress), buffer);
+    char digits[12];
+    struct iovec parts[WIZ_PARTS];
+    const struct WizPilot *pilot = &(DeviceTimings[device].pilot);
+
+    DeviceCounters[device].sent += 1;
+    WizTotals.sent += 1;
+
+    // The latency is measured from the first send, not from the request,
+    // since the device may not be reachable when requested.
+    if (!DeviceTimings[device].commandstart)
+        DeviceTimings[device].commandstart = housewiz_metrics_now();
+
+    parts[WIZ_PART_HEAD].iov_base = (void *)WizSetPilotHead;
+    parts[WIZ_PART_HEAD].iov_len = sizeof(WizSetPilotHead) - 1;
+    parts[WIZ_PART_ID].iov_base = digits;
+    parts[WIZ_PART_ID].iov_len =
+        housewiz_device_digits (WIZ_ID_OFFSET+device, digits);
+    if (state && housewiz_device_pilot_extended (pilot)) {
+        int length;
+        parts[WIZ_PART_TAIL].iov_base =
+            (void *)housewiz_device_pilot_tail (pilot, &length);
+        parts[WIZ_PART_TAIL].iov_len = length;
+    } else if (state) {
+        parts[WIZ_PART_TAIL].iov_base = (void *)WizSetPilotOn;
+        parts[WIZ_PART_TAIL].iov_len = sizeof(WizSetPilotOn);
+    } else {
+        parts[WIZ_PART_TAIL].iov_base = (void *)WizSetPilotOff;
+        parts[WIZ_PART_TAIL].iov_len = sizeof(WizSetPilotOff);
+    }
+    housewiz_device_send
+        (housewiz_device_socket_of (housewiz_device_network (device)),
+         WIZ_KEY(device, WIZ_KEY_CONTROL),
+         &(DeviceTimings[device].ipaddress), parts);
+}
+
+// Return the first time, at or after the requested time, in a second
+// that has room left for one more device query.
+//
+static long long housewiz_device_sense_slot (long long requested) {
+    int i;
+    if (WizSenseRate <= 0) return requested;
+    for (i = 0; i < WIZ_SENSE_RING; ++i) {
+        long long second = requested / 1000 + i;
+        int slot = second % WIZ_SENSE_RING;
+        if (WizSenseSlots[slot].second != second) {
+            WizSenseSlots[slot].second = second;
+            WizSenseSlots[slot].count = 0;
+        }
+        if (WizSenseSlots[slot].count < WizSenseRate) {
+            WizSenseSlots[slot].count += 1;
+            return i ? second * 1000 : requested;
+        }
+    }
+    return requested; // Too many devices for this rate: give up.
+}
+
+// Schedule the next periodic query of a device, with a random jitter.
+//
+static long long housewiz_device_sense_next (long long now) {
+    int jitter = (rand() % (2 * WIZ_SENSE_JITTER + 1)) - WIZ_SENSE_JITTER;
+    return housewiz_device_sense_slot (now + WIZ_SENSE_PERIOD + jitter);
+}
+
+// A device address restored from the state file is trusted until the
+// device is either detected or declared silent.
+//
+static int housewiz_device_reachable (int i, long long now) {
+    if (DeviceStates[i].detected) return 1;
+    return DeviceTimings[i].restored &&
+           (now < DeviceTimings[i].restored + WIZ_SILENT_TIMEOUT);
+}
+
+// The retry timeout of a device, derived from its confirmation times.
+//
+static int housewiz_device_rto (int i) {
+    int rto = WIZ_RTO_INITIAL;
+    if (DeviceTimings[i].srtt)
+        rto = DeviceTimings[i].srtt + 4 * DeviceTimings[i].rttvar;
+    if (rto < WIZ_RTO_MIN) rto = WIZ_RTO_MIN;
+    rto <<= DeviceTimings[i].backoff;
+    if (rto > WIZ_RTO_MAX) return WIZ_RTO_MAX;
+    return rto;
+}
+
+static void housewiz_device_rtt (int i, long long sample) {
+    if (sample <= 0) sample = 1;
+    if (sample > WIZ_COMMAND_MAX) sample = WIZ_COMMAND_MAX;
+    if (!DeviceTimings[i].srtt) {
+        DeviceTimings[i].srtt = (int)sample;
+        DeviceTimings[i].rttvar = (int)(sample / 2);
+    } else {
+        int delta = DeviceTimings[i].srtt - (int)sample;
+        if (delta < 0) delta = -delta;
+        DeviceTimings[i].rttvar = (3 * DeviceTimings[i].rttvar + delta) / 4;
+        DeviceTimings[i].srtt = (7 * DeviceTimings[i].srtt + (int)sample) / 8;
+        if (DeviceTimings[i].srtt <= 0) DeviceTimings[i].srtt = 1;
+    }
+    DeviceTimings[i].backoff = 0; // The device answers in time again.
+}
+
+// Start the retry cycle of a new command. The time allowed covers the
+// first send and all the retries, with their exponential backoff. The
+// latency measurement starts when the command is actually sent.
+//
+static void housewiz_device_start (int i, long long now) {
+    long long rto = housewiz_device_rto (i);
+    long long window = rto * ((2 << WIZ_RETRY_MAX) - 1);
+    if (window < WIZ_COMMAND_MIN) window = WIZ_COMMAND_MIN;
+    if (window > WIZ_COMMAND_MAX) window = WIZ_COMMAND_MAX;
+    DeviceTimings[i].commandstart = 0;
+    DeviceTimings[i].pending = now + window;
+    DeviceTimings[i].retry = now + rto;
+    DeviceTimings[i].attempts = 0;
+}
+
+// Calculate when the device needs attention next. This must be called
+// every time one of the device's deadlines moves earlier. A deadline
+// that moves later does not matter: housewiz_device_check() will find
+// that there is nothing to do yet and reschedule.
+//
+static void housewiz_device_arm (long long due) {
+
+    struct itimerspec timer;
+
+    if (WizTimer < 0) return;
+    if (due <= 0) due = 1; // A zero time would disarm the timer.
+
+    memset (&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = (time_t)(due / 1000);
+    timer.it_value.tv_nsec = (long)(due % 1000) * 1000000;
+    if (timerfd_settime (WizTimer, TFD_TIMER_ABSTIME, &timer, 0) < 0) {
+        houselog_trace (HOUSE_FAILURE, "TIMER",
+                        "timerfd_settime() error: %s", strerror(errno));
+        return;
+    }
+    WizTimerArmed = due;
+}
+
+static void housewiz_device_schedule (int i) {
+
+    long long due = DeviceTimings[i].next_sense;
+
+    if (DeviceStates[i].detected > 0) {
+        long long silent = DeviceStates[i].detected + WIZ_SILENT_TIMEOUT + 1;
+        if (silent < due) due = silent;
+    } else if (DeviceTimings[i].restored > 0) {
+        long long silent = DeviceTimings[i].restored + WIZ_SILENT_TIMEOUT;
+        if (silent < due) due = silent;
+    }
+    if (DeviceStates[i].deadline > 0 && DeviceStates[i].deadline < due)
+        due = DeviceStates[i].deadline;
+
+    if (DeviceStates[i].status != DeviceStates[i].commanded) {
+        long long next = DeviceTimings[i].pending;
+        if (DeviceTimings[i].retry > 0 && DeviceTimings[i].retry < next)
+            next = DeviceTimings[i].retry;
+        if (next < due) due = next;
+    }
+    housewiz_timer_set (i, due);
+    if ((!WizTimerArmed) || (due < WizTimerArmed)) housewiz_device_arm (due);
+}
+
+const char *housewiz_device_pilot_check (const struct WizPilot *pilot) {
+    if (pilot->dimming && ((pilot->dimming < 10) || (pilot->dimming > 100)))
+        return "invalid dimming value (10 to 100)";
+    if (pilot->temp && ((pilot->temp < 2200) || (pilot->temp > 6500)))
+        return "invalid temperature value (2200 to 6500)";
+    if (pilot->scene && ((pilot->scene < 1) || (pilot->scene > 32)))
+        return "invalid scene value (1 to 32)";
+    if ((pilot->temp != 0) + (pilot->scene != 0) + (pilot->color != 0) > 1)
+        return "temperature, color and scene are exclusive";
+    return 0;
+}
+
+static void housewiz_device_pilot_describe (const struct WizPilot *pilot,
+                                            char *text, int size) {
+    int l = 0;
+    text[0] = 0;
+    if (!housewiz_device_pilot_extended (pilot)) return;
+    if (pilot->dimming)
+        l += snprintf (text+l, size-l, " DIMMING %d", pilot->dimming);
+    if (pilot->temp && (l < size))
+        l += snprintf (text+l, size-l, " TEMPERATURE %d", pilot->temp);
+    if (pilot->scene && (l < size))
+        l += snprintf (text+l, size-l, " SCENE %d", pilot->scene);
+    if (pilot->color && (l < size))
+        snprintf (text+l, size-l, " COLOR %02x%02x%02x",
+                  pilot->red, pilot->green, pilot->blue);
 }
 
 int housewiz_device_set (int device, int state, int pulse) {
+    struct WizPilot pilot;
+    memset (&pilot, 0, sizeof(pilot));
+    pilot.state = state;
+    return housewiz_device_pilot (device, &pilot, pulse);
+}
+
+int housewiz_device_pilot (int device, const struct WizPilot *pilot, int pulse) {
 
+    int state = pilot->state;
     const char *namedstate = state?"on":"off";
-    time_t now = time(0);
+    char settings[96];
+    long long now = housewiz_metrics_now();
 
     if (device < 0 || device >= DevicesCount) return 0;
+    if (housewiz_device_pilot_check (pilot)) return -1;
+    housewiz_device_pilot_describe (pilot, settings, sizeof(settings));
 
     if (echttp_isdebug()) {
-        if (pulse) fprintf (stderr, "set %s to %s at %ld (pulse %ds)\n", Devices[device].name, namedstate, time(0), pulse);
-        else       fprintf (stderr, "set %s to %s at %ld\n", Devices[device].name, namedstate, time(0));
+        if (pulse) fprintf (stderr, "set %s to %s at %ld (pulse %ds)\n", DeviceConfigs[device].name, namedstate, time(0), pulse);
+        else       fprintf (stderr, "set %s to %s at %ld\n", DeviceConfigs[device].name, namedstate, time(0));
     }
 
     if (pulse > 0) {
-        Devices[device].deadline = now + pulse;
-        houselog_event ("DEVICE", Devices[device].name, "SET",
-                        "%s FOR %d SECONDS", namedstate, pulse);
+        DeviceStates[device].deadline = now + 1000LL * pulse;
+        houselog_event ("DEVICE", DeviceConfigs[device].name, "SET",
+                        "%s%s FOR %d SECONDS", namedstate, settings, pulse);
     } else {
-        Devices[device].deadline = 0;
-        houselog_event ("DEVICE", Devices[device].name, "SET", "%s", namedstate);
+        DeviceStates[device].deadline = 0;
+        houselog_event ("DEVICE", DeviceConfigs[device].name, "SET",
+                        "%s%s", namedstate, settings);
     }
-    Devices[device].commanded = state;
-    Devices[device].pending = now + 5;
+    DeviceStates[device].commanded = state;
+    DeviceTimings[device].pilot = *pilot;
+    housewiz_device_start (device, now);
+    housewiz_device_touch (device);
 
-    // Only send a command if we detected the device on the network.
+    // Only send a command if we know where the device is.
     //
-    if (Devices[device].detected) {
+    if (housewiz_device_reachable (device, now)) {
         housewiz_device_control (device, state);
-        Devices[device].last_sense = 0; // Get the state update asap.
+        DeviceTimings[device].next_sense = now; // Get the state update asap.
     }
+    housewiz_device_schedule (device);
     return 1;
 }
 
+static int housewiz_device_selected (const char *name) {
+    int length = strlen(name);
+    const char *p = WizInterfaces;
+    if (!WizInterfaces[0]) return 1;
+    if (!WizInterfaceSockets) return 1;
+    while (*p) {
+        const char *end = strchr (p, ',');
+        if (!end) end = p + strlen(p);
+        if ((end - p == length) && (!strncmp (p, name, length))) return 1;
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
 static int housewiz_device_enumerate_add (const char *name) {
     int i;
+    int free = -1;
     for (i = 0; i < NetworksCount; i++) {
         if (!strcmp (name, Networks[i].name)) return i;
+        if ((free < 0) && (!Networks[i].name[0])) free = i;
+    }
+    // Not found: reuse a free entry, or add a new one if there is room.
+    if (free < 0) {
+        if (NetworksCount >= NETWORKS_MAX) return -1;
+        free = NetworksCount++;
     }
-    // Not found: add new entry if there is room, or else overwrite the last.
-    if (NetworksCount >= NETWORKS_MAX) NetworksCount = NETWORKS_MAX - 1;
-    safecpy (Networks[NetworksCount].name, name, sizeof(Networks[0].name));
-    Networks[NetworksCount].ip[0] = 0;
-    Networks[NetworksCount].mac[0]= 0;
-    return NetworksCount++;
+    memset (Networks + free, 0, sizeof(Networks[0]));
+    safecpy (Networks[free].name, name, sizeof(Networks[0].name));
+    Networks[free].socket = -1;
+    return free;
+}
+
+static void housewiz_device_enumerate_close (int idx) {
+    if (Networks[idx].socket < 0) return;
+    if (WizReceiveThreads) housewiz_pipeline_detach (Networks[idx].socket);
+    echttp_forget (Networks[idx].socket);
+    close (Networks[idx].socket);
+    Networks[idx].socket = -1;
+    WizReceiveDroppedClosed += Networks[idx].dropped;
+    Networks[idx].dropped = 0;
 }
 
 static void housewiz_device_enumerate (void) {
@@ -310,23 +1095,49 @@ static void housewiz_device_enumerate (void) {
     struct ifaddrs *interfaces;
     struct ifaddrs *cursor;
 
-    NetworksCount = 0; // Erase the previous list.
-
     if (getifaddrs(&interfaces) < 0) return;
+
+    for (i = 0; i < NetworksCount; i++) Networks[i].seen = 0;
+
     for (cursor = interfaces; cursor; cursor = cursor->ifa_next) {
         if (cursor->ifa_flags & IFF_LOOPBACK) continue;
         if (!cursor->ifa_addr) continue;
+        if (!housewiz_device_selected (cursor->ifa_name)) continue;
         if (cursor->ifa_addr->sa_family == AF_INET) {
             int idx = housewiz_device_enumerate_add (cursor->ifa_name);
+            if (idx < 0) continue;
+            if (Networks[idx].seen) continue; // Keep the first address only.
+            Networks[idx].seen = 1;
             struct sockaddr_in *ia = (struct sockaddr_in *) (cursor->ifa_addr);
+            if (ia->sin_addr.s_addr != Networks[idx].address.s_addr) {
+                // New interface, or its address changed.
+                housewiz_device_enumerate_close (idx);
+                Networks[idx].address = ia->sin_addr;
+            }
             long ip = ntohl((long)(ia->sin_addr.s_addr));
             snprintf (Networks[idx].ip, sizeof(Networks[0].ip),
                       "%ld.%ld.%ld.%ld",
                       (ip>>24)&0xff, (ip>>16)&0xff, (ip>>8)&0xff, ip&0xff);
+
+            Networks[idx].netmask.s_addr = INADDR_BROADCAST;
+            if (cursor->ifa_netmask)
+                Networks[idx].netmask =
+                    ((struct sockaddr_in *)(cursor->ifa_netmask))->sin_addr;
+
+            Networks[idx].broadcast.sin_family = AF_INET;
+            Networks[idx].broadcast.sin_port = htons(WizDevicePort);
+            if ((cursor->ifa_flags & IFF_BROADCAST) && cursor->ifa_broadaddr)
+                Networks[idx].broadcast.sin_addr =
+                    ((struct sockaddr_in *)(cursor->ifa_broadaddr))->sin_addr;
+            else
+                Networks[idx].broadcast.sin_addr.s_addr =
+                    ia->sin_addr.s_addr | ~(Networks[idx].netmask.s_addr);
+
         } else if (cursor->ifa_addr->sa_family == AF_PACKET) {
             struct sockaddr_ll *mac = (struct sockaddr_ll*) (cursor->ifa_addr);
             if (mac->sll_halen >= sizeof(Networks[0].mac)) continue;
             int idx = housewiz_device_enumerate_add (cursor->ifa_name);
+            if (idx < 0) continue;
             for (i = 0; i < mac->sll_halen; i++) {
                 Networks[idx].mac[i*2] = bin2hex[(mac->sll_addr[i])/16];
                 Networks[idx].mac[i*2+1] = bin2hex[(mac->sll_addr[i])&15];
@@ -334,79 +1145,523 @@ static void housewiz_device_enumerate (void) {
             Networks[idx].mac[i*2] = 0;
         }
     }
+    freeifaddrs (interfaces);
+
+    // Forget the interfaces that disappeared (or have no IP address),
+    // and open a socket for the new ones.
+    //
+    for (i = 0; i < NetworksCount; i++) {
+        if (!Networks[i].name[0]) continue;
+        if (!Networks[i].seen) {
+            housewiz_device_enumerate_close (i);
+            Networks[i].name[0] = 0;
+            continue;
+        }
+        char payload[sizeof(Networks[0].registration)];
+        int length =
+            snprintf (payload, sizeof(payload),
+                      ", \"params\":{\"phoneIp\": \"%s\", \"register\":true, "
+                      "\"phoneMac\":\"%s\"}}", Networks[i].ip, Networks[i].mac);
+        if (length >= sizeof(payload)) length = sizeof(payload) - 1;
+        memcpy (Networks[i].registration, payload, length + 1);
+        Networks[i].registrationlength = length;
+        if (WizInterfaceSockets && (Networks[i].socket < 0)) {
+            Networks[i].socket =
+                housewiz_device_bind (Networks[i].address, Networks[i].name,
+                                      housewiz_device_port ());
+            if (Networks[i].socket >= 0)
+                housewiz_device_listen (Networks[i].socket);
+        }
+    }
+    while ((NetworksCount > 0) && (!Networks[NetworksCount-1].name[0]))
+        NetworksCount -= 1;
+
     if (echttp_isdebug()) {
         for (i = 0; i < NetworksCount; i++) {
-            fprintf (stderr, "Interface %s: IP %s, MAC %s\n",
-                     Networks[i].name, Networks[i].ip, Networks[i].mac);
+            if (!Networks[i].name[0]) continue;
+            fprintf (stderr, "Interface %s: IP %s, MAC %s, broadcast %s\n",
+                     Networks[i].name, Networks[i].ip, Networks[i].mac,
+                     inet_ntoa (Networks[i].broadcast.sin_addr));
         }
     }
 }
 
-static void housewiz_device_reset (int i, int status) {
-    Devices[i].commanded = Devices[i].status = status;
-    Devices[i].pending = Devices[i].deadline = 0;
+// Enumerate the interfaces again when the kernel reports a change. All
+// the pending events are consumed first, so that a burst of events
+// causes only one enumeration.
+//
+static void housewiz_device_netlink (int fd, int mode) {
+
+    static union {
+        char buffer[8192];
+        struct nlmsghdr align;
+    } events;
+    int changed = 0;
+
+    for (;;) {
+        int length = recv (fd, events.buffer, sizeof(events.buffer), MSG_DONTWAIT);
+        if (length < 0) {
+            if (errno == ENOBUFS) { // Events were lost.
+                changed = 1;
+                continue;
+            }
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (length == 0) break;
+        struct nlmsghdr *h;
+        for (h = &(events.align); NLMSG_OK(h, length); h = NLMSG_NEXT(h, length)) {
+            switch (h->nlmsg_type) {
+                case RTM_NEWLINK:
+                case RTM_DELLINK:
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                    changed = 1;
+                    break;
+            }
+        }
+    }
+    if (changed) housewiz_device_enumerate();
 }
 
-void housewiz_device_periodic (time_t now) {
+static void housewiz_device_netlink_open (void) {
 
-    static time_t LastRetry = 0;
-    static time_t LastSense = 0;
-    int i;
+    struct sockaddr_nl local;
 
-    if (now >= LastSense + 60) {
-        housewiz_device_enumerate();
-        housewiz_device_sense(&WizBroadcast, 1);
-        LastSense = now;
+    WizNetlink = socket (AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (WizNetlink < 0) {
+        houselog_trace (HOUSE_FAILURE, "NETLINK",
+                        "cannot open socket: %s", strerror(errno));
+        return;
+    }
+    memset (&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (bind (WizNetlink, (struct sockaddr *)(&local), sizeof(local)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "NETLINK",
+                        "cannot subscribe to interface events: %s",
+                        strerror(errno));
+        close (WizNetlink);
+        WizNetlink = -1;
+        return;
+    }
+    echttp_listen (WizNetlink, 1, housewiz_device_netlink, 0);
+}
+
+// Grow the device arrays. The new entries are cleared.
+//
+static int housewiz_device_grow (int space) {
+
+    struct DeviceState *states =
+        realloc (DeviceStates, space * sizeof(struct DeviceState));
+    if (states) DeviceStates = states;
+    struct DeviceTiming *timings =
+        realloc (DeviceTimings, space * sizeof(struct DeviceTiming));
+    if (timings) DeviceTimings = timings;
+    struct DeviceConfig *configs =
+        realloc (DeviceConfigs, space * sizeof(struct DeviceConfig));
+    if (configs) DeviceConfigs = configs;
+    struct WizCounters *counters =
+        realloc (DeviceCounters, space * sizeof(struct WizCounters));
+    if (counters) DeviceCounters = counters;
+    if ((!states) || (!timings) || (!configs) || (!counters)) return 0;
+
+    int added = space - DevicesSpace;
+    memset (DeviceStates + DevicesSpace, 0, added * sizeof(struct DeviceState));
+    memset (DeviceTimings + DevicesSpace, 0, added * sizeof(struct DeviceTiming));
+    memset (DeviceConfigs + DevicesSpace, 0, added * sizeof(struct DeviceConfig));
+    memset (DeviceCounters + DevicesSpace, 0, added * sizeof(struct WizCounters));
+    DevicesSpace = space;
+    return 1;
+}
+
+static int housewiz_device_mac_binary (const char *text, int length,
+                                       unsigned char *mac) {
+    // Accept 12 hexadecimal digits, optionally separated with ':' or '-'.
+    int digits = 0;
+    const char *end = text + length;
+    for (; text < end; ++text) {
+        int nibble;
+        char c = *text;
+        if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else if (c == ':' || c == '-') continue;
+        else return 0;
+        if (digits >= 12) return 0;
+        if (digits & 1) mac[digits/2] |= nibble;
+        else            mac[digits/2] = nibble << 4;
+        digits += 1;
     }
+    return (digits == 12);
+}
 
-    if (now < LastRetry + 5) return;
-    LastRetry = now;
+static unsigned int housewiz_device_name_hash (const char *name) {
+    return housewiz_hash (name, strlen(name));
+}
 
-    for (i = 0; i < DevicesCount; ++i) {
+// Insert the device in the indexes, keeping the first occurrence
+// of a duplicate MAC address or name.
+//
+static void housewiz_device_index_insert (int device) {
+
+    unsigned int mask = DeviceIndexSize - 1;
+    unsigned int slot;
 
-        if (now >= Devices[i].last_sense + 35) {
-            housewiz_device_sense(&(Devices[i].ipaddress), WIZ_ID_OFFSET+i);
-            Devices[i].last_sense = now;
+    if (DeviceConfigs[device].macvalid) {
+        slot = housewiz_hash (DeviceConfigs[device].mac, 6) & mask;
+        while (DeviceMacIndex[slot] != DEVICE_INDEX_EMPTY) {
+            if (!memcmp (DeviceConfigs[DeviceMacIndex[slot]].mac,
+                         DeviceConfigs[device].mac, 6)) break;
+            slot = (slot + 1) & mask;
         }
+        if (DeviceMacIndex[slot] == DEVICE_INDEX_EMPTY)
+            DeviceMacIndex[slot] = device;
+    }
 
-        // If we did not detect a device for 3 senses, consider it failed.
-        if (Devices[i].detected > 0 && Devices[i].detected < now - 100) {
-            houselog_event ("DEVICE", Devices[i].name, "SILENT",
-                            "MAC ADDRESS %s", Devices[i].macaddress);
-            housewiz_device_reset (i, 0);
-            Devices[i].detected = 0;
+    if (DeviceConfigs[device].name[0]) {
+        slot = housewiz_device_name_hash (DeviceConfigs[device].name) & mask;
+        while (DeviceNameIndex[slot] != DEVICE_INDEX_EMPTY) {
+            if (!strcmp (DeviceConfigs[DeviceNameIndex[slot]].name,
+                         DeviceConfigs[device].name)) break;
+            slot = (slot + 1) & mask;
         }
+        if (DeviceNameIndex[slot] == DEVICE_INDEX_EMPTY)
+            DeviceNameIndex[slot] = device;
+    }
+}
+
+static void housewiz_device_index_rebuild (void) {
+    int i;
+    int size = 64;
+    while (size < 2 * DevicesSpace) size *= 2;
+    if (size != DeviceIndexSize) {
+        int *macindex = realloc (DeviceMacIndex, size * sizeof(int));
+        if (macindex) DeviceMacIndex = macindex;
+        int *nameindex = realloc (DeviceNameIndex, size * sizeof(int));
+        if (nameindex) DeviceNameIndex = nameindex;
+        int *senderindex = realloc (DeviceSenderIndex, size * sizeof(int));
+        if (senderindex) DeviceSenderIndex = senderindex;
+        if ((!macindex) || (!nameindex) || (!senderindex)) {
+            houselog_trace (HOUSE_FAILURE, "DEVICE", "no more memory");
+            exit(1);
+        }
+        DeviceIndexSize = size;
+    }
+    for (i = 0; i < size; ++i)
+        DeviceMacIndex[i] = DeviceNameIndex[i] =
+            DeviceSenderIndex[i] = DEVICE_INDEX_EMPTY;
+    for (i = 0; i < DevicesCount; ++i) housewiz_device_index_insert (i);
+}
+
+int housewiz_device_find (const char *name) {
+
+    if (!DeviceNameIndex) return -1;
+
+    unsigned int mask = DeviceIndexSize - 1;
+    unsigned int slot = housewiz_device_name_hash (name) & mask;
+    while (DeviceNameIndex[slot] != DEVICE_INDEX_EMPTY) {
+        int device = DeviceNameIndex[slot];
+        if (!strcmp (DeviceConfigs[device].name, name)) return device;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static int housewiz_device_mac_lookup (const unsigned char *mac) {
+
+    if (!DeviceMacIndex) return -1;
+
+    unsigned int mask = DeviceIndexSize - 1;
+    unsigned int slot = housewiz_hash (mac, 6) & mask;
+    while (DeviceMacIndex[slot] != DEVICE_INDEX_EMPTY) {
+        int device = DeviceMacIndex[slot];
+        if (!memcmp (DeviceConfigs[device].mac, mac, 6)) return device;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static int housewiz_device_mac_search (const char *macaddress, int length) {
+    int i;
+    unsigned char mac[6];
 
-        if (Devices[i].deadline > 0 && now >= Devices[i].deadline) {
-            houselog_event ("DEVICE", Devices[i].name, "RESET", "END OF PULSE");
-            Devices[i].commanded = 0;
-            Devices[i].pending = now + 5;
-            Devices[i].deadline = 0;
+    if (!housewiz_device_mac_binary (macaddress, length, mac)) {
+        // Not a valid MAC address: cannot be indexed, use a slow search.
+        for (i = 0; i < DevicesCount; ++i) {
+            if ((!strncasecmp(macaddress, DeviceConfigs[i].macaddress, length)) &&
+                (DeviceConfigs[i].macaddress[length] == 0)) return i;
         }
-        if (Devices[i].status != Devices[i].commanded) {
-            if (Devices[i].pending > now) {
-                if (Devices[i].detected) {
-                    const char *state = Devices[i].commanded?"on":"off";
-                    houselog_event ("DEVICE", Devices[i].name, "RETRY", state);
-                    housewiz_device_control (i, Devices[i].commanded);
+        return -1;
+    }
+    return housewiz_device_mac_lookup (mac);
+}
+
+static void housewiz_device_reset (int i, int status) {
+    DeviceStates[i].commanded = DeviceStates[i].status = status;
+    DeviceTimings[i].pending = DeviceTimings[i].retry = DeviceStates[i].deadline = 0;
+}
+
+static void housewiz_device_check (int i, long long now) {
+
+    if (now >= DeviceTimings[i].next_sense) {
+        housewiz_device_sense(i);
+        DeviceTimings[i].next_sense = housewiz_device_sense_next (now);
+    }
+
+    // If we did not detect a device for 3 senses, consider it failed.
+    if (DeviceStates[i].detected > 0 &&
+        DeviceStates[i].detected < now - WIZ_SILENT_TIMEOUT) {
+        if (housewiz_event_allow (i, DeviceConfigs[i].name,
+                                  WIZ_EVENT_SILENT, -1, -1, now))
+            houselog_event ("DEVICE", DeviceConfigs[i].name, "SILENT",
+                            "MAC ADDRESS %s", DeviceConfigs[i].macaddress);
+        housewiz_device_reset (i, 0);
+        DeviceStates[i].detected = 0;
+        housewiz_device_touch (i);
+    }
+
+    // A restored device that never answered is now reported as silent.
+    if ((!DeviceStates[i].detected) && DeviceTimings[i].restored &&
+        (now >= DeviceTimings[i].restored + WIZ_SILENT_TIMEOUT)) {
+        DeviceTimings[i].restored = 0;
+        housewiz_device_touch (i);
+    }
+
+    if (DeviceStates[i].deadline > 0 && now >= DeviceStates[i].deadline) {
+        houselog_event ("DEVICE", DeviceConfigs[i].name, "RESET", "END OF PULSE");
+        DeviceStates[i].commanded = 0;
+        housewiz_device_start (i, now);
+        DeviceStates[i].deadline = 0;
+        housewiz_device_touch (i);
+        if (housewiz_device_reachable (i, now) && DeviceStates[i].status)
+            housewiz_device_control (i, 0);
+    }
+    if (DeviceStates[i].status != DeviceStates[i].commanded) {
+        if (DeviceTimings[i].pending > now) {
+            if (DeviceTimings[i].retry > 0 && now >= DeviceTimings[i].retry) {
+                if (housewiz_device_reachable (i, now)) {
+                    int commanded = DeviceStates[i].commanded;
+                    if (housewiz_event_allow (i, DeviceConfigs[i].name,
+                                              WIZ_EVENT_RETRY, -1, commanded, now))
+                        houselog_event ("DEVICE", DeviceConfigs[i].name,
+                                        "RETRY", commanded?"on":"off");
+                    DeviceCounters[i].retries += 1;
+                    WizTotals.retries += 1;
+                    housewiz_device_control (i, DeviceStates[i].commanded);
                 }
-            } else {
-                // The ongoing command timed out, forget and cleanup.
-                if (Devices[i].pending)
-                    houselog_event ("DEVICE", Devices[i].name, "TIMEOUT", "");
-                housewiz_device_reset (i, Devices[i].status);
+                DeviceTimings[i].attempts += 1;
+                if (DeviceTimings[i].attempts < WIZ_RETRY_MAX) {
+                    long long delay = (long long)housewiz_device_rto (i)
+                                          << DeviceTimings[i].attempts;
+                    if (delay > WIZ_RTO_MAX) delay = WIZ_RTO_MAX;
+                    DeviceTimings[i].retry = now + delay;
+                } else {
+                    DeviceTimings[i].retry = 0; // Wait until the timeout.
+                }
+            }
+        } else {
+            // The ongoing command timed out, forget and cleanup.
+            if (DeviceTimings[i].pending) {
+                if (housewiz_event_allow (i, DeviceConfigs[i].name,
+                                          WIZ_EVENT_TIMEOUT, -1, -1, now))
+                    houselog_event ("DEVICE", DeviceConfigs[i].name, "TIMEOUT", "");
+                DeviceCounters[i].timeouts += 1;
+                WizTotals.timeouts += 1;
+                // Keep the measured times, but wait longer next time.
+                if (DeviceTimings[i].backoff < WIZ_BACKOFF_MAX)
+                    DeviceTimings[i].backoff += 1;
+            }
+            housewiz_device_reset (i, DeviceStates[i].status);
+            housewiz_device_touch (i);
+        }
+    }
+}
+
+static void housewiz_device_expire (long long now) {
+    int i;
+    while ((i = housewiz_timer_expired (now)) >= 0) {
+        if (i >= DevicesCount) continue; // Stale, should not happen.
+        housewiz_device_check (i, now);
+        housewiz_device_schedule (i);
+    }
+}
+
+static void housewiz_device_timer (int fd, int mode) {
+
+    uint64_t expirations;
+
+    if (read (fd, &expirations, sizeof(expirations)) < 0) return;
+
+    long long start = housewiz_metrics_start ();
+    WizTimerArmed = 0;
+    housewiz_device_expire (housewiz_metrics_now());
+    long long next = housewiz_timer_next ();
+    if (next) housewiz_device_arm (next);
+    housewiz_metrics_stop (WIZ_PROBE_PERIODIC, start);
+}
+
+static void housewiz_device_cache_save (void) {
+
+    static struct WizCacheEntry *entries = 0;
+    static int space = 0;
+    int count = 0;
+    int i;
+
+    if (DevicesCount > space) {
+        struct WizCacheEntry *newentries =
+            realloc (entries, DevicesCount * sizeof(struct WizCacheEntry));
+        if (!newentries) return;
+        entries = newentries;
+        space = DevicesCount;
+    }
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!DeviceConfigs[i].macvalid) continue;
+        if (!DeviceTimings[i].ipaddress.sin_addr.s_addr) continue;
+        struct WizCacheEntry *entry = entries + count++;
+        memset (entry, 0, sizeof(*entry));
+        memcpy (entry->mac, DeviceConfigs[i].mac, sizeof(entry->mac));
+        entry->status = DeviceStates[i].status;
+        entry->address = DeviceTimings[i].ipaddress.sin_addr;
+        memcpy (entry->firmware, DeviceTimings[i].firmware,
+                sizeof(entry->firmware));
+    }
+    housewiz_cache_save (entries, count);
+}
+
+// Restore one device from the state file, and query it right away.
+// The devices that are not in the configuration are ignored: these will
+// be added when they answer the broadcast. Return 1 if restored.
+//
+static int housewiz_device_restore (const struct WizCacheEntry *entry) {
+
+    int device = housewiz_device_mac_lookup (entry->mac);
+    if (device < 0) return 0;
+    if (DeviceStates[device].detected) return 0; // Already more recent.
+
+    struct sockaddr_in *a = &(DeviceTimings[device].ipaddress);
+    memset (a, 0, sizeof(*a));
+    a->sin_family = AF_INET;
+    a->sin_addr = entry->address;
+    a->sin_port = htons(WizDevicePort);
+    DeviceTimings[device].network = 0;
+    DeviceTimings[device].restored = housewiz_metrics_now();
+    memcpy (DeviceTimings[device].firmware, entry->firmware,
+            sizeof(DeviceTimings[device].firmware));
+
+    // Avoid reporting a "change" when the device confirms its state.
+    DeviceStates[device].status = DeviceStates[device].commanded =
+        entry->status ? 1 : 0;
+    housewiz_device_touch (device);
+    housewiz_device_sense (device);
+    return 1;
+}
+
+void housewiz_device_periodic (long long now) {
+
+    static long long LastSense = 0;
+
+    if ((!LastSense) || (now >= LastSense + 60000)) {
+        static unsigned long LastDropped = 0;
+        unsigned long dropped = housewiz_device_dropped();
+        if (dropped != LastDropped) {
+            houselog_trace (HOUSE_FAILURE, "SOCKET",
+                            "%lu packets lost (%lu truncated since startup)",
+                            dropped - LastDropped, WizReceiveTruncated);
+            LastDropped = dropped;
+        }
+        if (WizNetlink < 0) housewiz_device_enumerate();
+        housewiz_device_discover();
+        LastSense = now;
+    }
+    if (WizTimer < 0) housewiz_device_expire (now);
+    housewiz_event_periodic (now);
+
+    if (WizCacheChanged && (now >= WizCacheSaved + WIZ_CACHE_DELAY)) {
+        housewiz_device_cache_save ();
+        WizCacheChanged = 0;
+        WizCacheSaved = now;
+    }
+}
+
+// Retrieve one device entry from the configuration. The MAC address
+// is the key of the entry: return a null pointer if there is none.
+//
+static const char *housewiz_device_entry (int devices, int index,
+                                          const char **name,
+                                          const char **desc) {
+    char path[128];
+    snprintf (path, sizeof(path), "[%d]", index);
+    int device = houseconfig_object (devices, path);
+    if (device <= 0) return 0;
+    *name = houseconfig_string (device, ".name");
+    *desc = houseconfig_string (device, ".description");
+    if (!*name) *name = "";
+    if (!*desc) *desc = "";
+    return houseconfig_string (device, ".address");
+}
+
+static void housewiz_device_configure (struct DeviceConfig *config,
+                                       const char *name,
+                                       const char *mac,
+                                       const char *desc) {
+    safecpy (config->name, name, sizeof(config->name));
+    safecpy (config->macaddress, mac, sizeof(config->macaddress));
+    config->macvalid =
+        housewiz_device_mac_binary (mac, strlen(mac), config->mac);
+    safecpy (config->description, desc, sizeof(config->description));
+}
+
+// The list of devices did not change: only update the names and
+// descriptions that changed. All the device's state is kept.
+//
+static void housewiz_device_refresh_inplace (int devices) {
+
+    int i;
+    int changed = 0;
+    int renamed = 0;
+    char (*oldnames)[32] = 0;
+
+    for (i = 0; i < DevicesCount; ++i) {
+        const char *name;
+        const char *desc;
+        const char *mac = housewiz_device_entry (devices, i, &name, &desc);
+        struct DeviceConfig *config = DeviceConfigs + i;
+
+        if (strncmp (config->name, name, sizeof(config->name)-1)) {
+            if (!oldnames) oldnames = calloc (DevicesCount, sizeof(*oldnames));
+            if (oldnames) memcpy (oldnames[i], config->name, sizeof(oldnames[0]));
+            safecpy (config->name, name, sizeof(config->name));
+            housewiz_device_touch (i);
+            renamed = changed = 1;
+        }
+        if (strncmp (config->description, desc, sizeof(config->description)-1)) {
+            safecpy (config->description, desc, sizeof(config->description));
+            changed = 1;
+        }
+        if (echttp_isdebug())
+            fprintf (stderr, "keep device %s, MAC address %s (%s)\n",
+                     config->name, mac, config->description);
+    }
+    if (renamed) {
+        housewiz_device_index_rebuild ();
+        if (oldnames) {
+            for (i = 0; i < DevicesCount; ++i) {
+                if (!oldnames[i][0]) continue;
+                if (housewiz_device_find (oldnames[i]) < 0)
+                    housewiz_device_record_removal (oldnames[i]);
             }
+            free (oldnames);
         }
     }
+    if (changed) DeviceConfigGeneration += 1;
 }
 
 const char *housewiz_device_refresh (const char *reason) {
 
     int i;
-    int devices;
-    int oldcount = DevicesCount;
-    struct DeviceMap *oldcfg = Devices;
-    struct DeviceMap *newcfg;
+    int devices = -1;
+    int count = 0;
 
     houselog_event ("CONFIG", "wiz", "ACTIVATING", "%s", reason);
 
@@ -414,233 +1669,672 @@ const char *housewiz_device_refresh (const char *reason) {
         devices = houseconfig_array (0, ".wiz.devices");
         if (devices < 0) return "cannot find devices array";
 
-        DevicesCount = houseconfig_array_length (devices);
-        if (echttp_isdebug()) fprintf (stderr, "found %d devices\n", DevicesCount);
-    } else {
-        DevicesCount = 0;
+        count = houseconfig_array_length (devices);
+        if (echttp_isdebug()) fprintf (stderr, "found %d devices\n", count);
     }
-    DevicesSpace = DevicesCount + 32;
+    if (housewiz_group_refresh ()) DeviceConfigGeneration += 1;
 
-    newcfg = calloc(sizeof(struct DeviceMap), DevicesSpace);
-    if (!newcfg) return "no more memory";
-    Devices = newcfg;
+    // Most updates do not change the list of devices. Detect this case
+    // by matching MAC addresses in order.
+    //
+    if (count == DevicesCount) {
+        for (i = 0; i < count; ++i) {
+            const char *name;
+            const char *desc;
+            const char *mac = housewiz_device_entry (devices, i, &name, &desc);
+            if ((!mac) || strcmp (mac, DeviceConfigs[i].macaddress)) break;
+        }
+        if (i >= count) {
+            housewiz_device_refresh_inplace (devices);
+            return 0;
+        }
+    }
 
-    for (i = 0; i < DevicesCount; ++i) {
-        int device;
-        char path[128];
-        snprintf (path, sizeof(path), "[%d]", i);
-        device = houseconfig_object (devices, path);
-        if (device <= 0) continue;
-        const char *name = houseconfig_string (device, ".name");
-        if (name)
-            safecpy (Devices[i].name, name, sizeof(Devices[i].name));
-        const char *mac = houseconfig_string (device, ".address");
-        if (mac)
-            safecpy (Devices[i].macaddress, mac, sizeof(Devices[i].macaddress));
-        const char *desc = houseconfig_string (device, ".description");
-        if (desc)
-            safecpy (Devices[i].description, desc,
-                     sizeof(Devices[i].description));
-
-        Devices[i].deadline = 0;
-        Devices[i].pending = 0;
-        Devices[i].detected = 0;
-        Devices[i].reboot = 0;
-        Devices[i].last_sense = 0;
-
-        if (oldcfg) {
-            int j;
-            for (j = 0; j < oldcount; ++j) {
-                if (!strcmp(Devices[i].macaddress, oldcfg[j].macaddress)) {
-                    // Recover the last status known.
-                    Devices[i].detected = oldcfg[j].detected;
-                    Devices[i].reboot = oldcfg[j].reboot;
-                    Devices[i].last_sense = oldcfg[j].last_sense;
-                    housewiz_device_reset (i, oldcfg[j].status);
-                    break;
-                }
-            }
+    // The list of devices changed. Build a new list, matching the old
+    // devices by MAC address to retain all their state. The event windows
+    // and the keys of the queued packets are per device index, and must be
+    // flushed before the indexes move.
+    //
+    housewiz_event_reset ();
+    housewiz_queue_forget ();
+    int space = count + 32;
+    struct DeviceState  *newstates = calloc (sizeof(struct DeviceState), space);
+    struct DeviceTiming *newtimings = calloc (sizeof(struct DeviceTiming), space);
+    struct DeviceConfig *newconfigs = calloc (sizeof(struct DeviceConfig), space);
+    struct WizCounters  *newcounters = calloc (sizeof(struct WizCounters), space);
+    if ((!newstates) || (!newtimings) || (!newconfigs) || (!newcounters)) {
+        free (newstates);
+        free (newtimings);
+        free (newconfigs);
+        free (newcounters);
+        return "no more memory";
+    }
+
+    DeviceGeneration += 1;
+    for (i = 0; i < count; ++i) {
+        const char *name;
+        const char *desc;
+        const char *mac = housewiz_device_entry (devices, i, &name, &desc);
+        if (!mac) mac = "";
+
+        // The search is done in the old list, which is still current.
+        int old = housewiz_device_mac_search (mac, strlen(mac));
+        if (old >= 0) {
+            newstates[i] = DeviceStates[old];
+            newtimings[i] = DeviceTimings[old];
+            newcounters[i] = DeviceCounters[old];
+            if (strcmp (DeviceConfigs[old].name, name))
+                newstates[i].changed = DeviceGeneration;
+        } else {
+            newstates[i].changed = DeviceGeneration;
         }
+        housewiz_device_configure (newconfigs + i, name, mac, desc);
 
         if (echttp_isdebug())
-            fprintf (stderr, "load device %s, MAC address %s (%s)\n",
-                     Devices[i].name, Devices[i].macaddress,
-                     desc?desc:"no description");
+            fprintf (stderr, "%s device %s, MAC address %s (%s)\n",
+                     (old >= 0)?"keep":"load", name, mac, desc);
+    }
+
+    int oldcount = DevicesCount;
+    struct DeviceState  *oldstates = DeviceStates;
+    struct DeviceTiming *oldtimings = DeviceTimings;
+    struct DeviceConfig *oldconfigs = DeviceConfigs;
+    struct WizCounters  *oldcounters = DeviceCounters;
+
+    DeviceStates = newstates;
+    DeviceTimings = newtimings;
+    DeviceConfigs = newconfigs;
+    DeviceCounters = newcounters;
+    DevicesCount = count;
+    DevicesSpace = space;
+    housewiz_device_index_rebuild ();
+
+    for (i = 0; i < oldcount; ++i) {
+        if (!oldconfigs[i].name[0]) continue;
+        if (housewiz_device_find (oldconfigs[i].name) < 0)
+            housewiz_device_record_removal (oldconfigs[i].name);
+    }
+    // This is safe now that the new config is in place.
+    free (oldstates);
+    free (oldtimings);
+    free (oldconfigs);
+    free (oldcounters);
+
+    // Spread the first query of the new devices over one sense period.
+    //
+    long long now = housewiz_metrics_now();
+    for (i = 0; i < DevicesCount; ++i) {
+        if (DeviceTimings[i].next_sense) continue;
+        long long requested =
+            now + ((long long)i * WIZ_SENSE_PERIOD) / DevicesCount;
+        DeviceTimings[i].next_sense = housewiz_device_sense_slot (requested);
     }
-    if (oldcfg) free(oldcfg); // This is safe now that the new config is in place.
+
+    // The device indexes changed: all timers must be recalculated.
+    //
+    housewiz_timer_reset ();
+    for (i = 0; i < DevicesCount; ++i) housewiz_device_schedule (i);
+    DeviceConfigGeneration += 1;
     return 0;
 }
 
-const char *housewiz_device_live_config (char *buffer, int size) {
-
-    static char pool[65537];
-    static ParserToken token[1024];
-    ParserContext context = echttp_json_start (token, 1024, pool, sizeof(pool));
+const char *housewiz_device_live_config (const char **error) {
 
+    static struct WizJson json;
     int i;
 
-    int root = echttp_json_add_object (context, 0, 0);
-    int top = echttp_json_add_object (context, root, "wiz");
-    int items = echttp_json_add_array (context, top, "devices");
+    housewiz_json_start (&json);
+    housewiz_json_object (&json, 0);
+    housewiz_json_object (&json, "wiz");
+    housewiz_json_array (&json, "devices");
 
     for (i = 0; i < DevicesCount; ++i) {
-        if (Devices[i].name[0] == 0 || Devices[i].macaddress[0] == 0) continue;
-        int device = echttp_json_add_object (context, items, 0);
-        echttp_json_add_string (context, device, "name", Devices[i].name);
-        echttp_json_add_string (context, device, "address", Devices[i].macaddress);
-        echttp_json_add_string
-            (context, device, "description", Devices[i].description);
+        if (DeviceConfigs[i].name[0] == 0 ||
+            DeviceConfigs[i].macaddress[0] == 0) continue;
+        housewiz_json_object (&json, 0);
+        housewiz_json_string (&json, "name", DeviceConfigs[i].name);
+        housewiz_json_string (&json, "address", DeviceConfigs[i].macaddress);
+        housewiz_json_string (&json, "description", DeviceConfigs[i].description);
+        housewiz_json_end (&json);
     }
-    return echttp_json_export (context, buffer, size);
+    housewiz_json_end (&json);
+    housewiz_group_live_config (&json);
+    return housewiz_json_export (&json, error);
 }
 
-static int housewiz_device_mac_search (const char *macaddress) {
-    int i;
-    for (i = 0; i < DevicesCount; ++i) {
-        if (!strcasecmp(macaddress, Devices[i].macaddress)) return i;
+const struct WizLight *housewiz_device_light (int point) {
+    static const struct WizLight unknown;
+    if (point < 0 || point >= DevicesCount) return &unknown;
+    return &(DeviceStates[point].light);
+}
+
+static uint64_t housewiz_device_fingerprint (const char *data, int length) {
+    uint64_t hash = housewiz_hash64 (data, length);
+    return hash ? hash : 1; // 0 means no fingerprint.
+}
+
+static unsigned int housewiz_device_sender_slot (const struct sockaddr_in *addr) {
+    return (ntohl(addr->sin_addr.s_addr) * 2654435761u) & (DeviceIndexSize - 1);
+}
+
+// Recognize a heartbeat that is identical to the last message received
+// from the same device: it does not need to be decoded. Return the
+// device, or -1.
+//
+static int housewiz_device_heartbeat (const struct sockaddr_in *addr,
+                                      uint64_t fingerprint) {
+    if (!DeviceSenderIndex) return -1;
+    int device = DeviceSenderIndex[housewiz_device_sender_slot (addr)];
+    if ((device < 0) || (device >= DevicesCount)) return -1;
+    if (DeviceTimings[device].fingerprint != fingerprint) return -1;
+    if (DeviceTimings[device].ipaddress.sin_addr.s_addr != addr->sin_addr.s_addr)
+        return -1;
+    if (!DeviceStates[device].detected) return -1;
+    return device;
+}
+
+// Account for a heartbeat identical to the previous one, if it is.
+// Return 1 if the message needs no further processing.
+//
+static int housewiz_device_unchanged (const struct sockaddr_in *addr,
+                                      uint64_t fingerprint, long long now) {
+    int known = housewiz_device_heartbeat (addr, fingerprint);
+    if (known < 0) return 0;
+    DeviceCounters[known].received += 1;
+    DeviceStates[known].detected = now;
+    WizHeartbeatsUnchanged += 1;
+    return 1;
+}
+
+static void housewiz_device_update_light (int device,
+                                          const struct WizMessage *message) {
+    struct WizLight light;
+    memset (&light, 0, sizeof(light));
+    if (message->dimming > 0) light.dimming = message->dimming;
+    if (message->temp > 0) light.temp = message->temp;
+    if (message->scene > 0) light.scene = message->scene;
+    if ((message->red >= 0) && (message->green >= 0) && (message->blue >= 0)) {
+        light.color = 1;
+        light.red = message->red;
+        light.green = message->green;
+        light.blue = message->blue;
+    }
+    if ((message->rssi < 0) && (message->rssi >= -128)) light.rssi = message->rssi;
+
+    struct WizLight *current = &(DeviceStates[device].light);
+    if ((light.dimming != current->dimming) || (light.temp != current->temp) ||
+        (light.scene != current->scene) || (light.color != current->color) ||
+        (light.red != current->red) || (light.green != current->green) ||
+        (light.blue != current->blue)) {
+        *current = light;
+        housewiz_device_touch (device);
+    } else {
+        current->rssi = light.rssi;
     }
-    return -1;
 }
 
-static void housewiz_device_receive (int fd, int mode) {
+static void housewiz_device_apply (const struct WizMessage *message,
+                                   const char *data,
+                                   const struct sockaddr_in *addr,
+                                   uint64_t fingerprint, long long now);
 
-    time_t now = time(0);
-    char data[256];
-    struct sockaddr_in addr;
-    int addrlen = sizeof(addr);
-
-    int size = recvfrom (WizSocket, data, sizeof(data), 0,
-                         (struct sockaddr *)(&addr), &addrlen);
-    if (size > 0) {
-        data[size] = 0;
-        if (echttp_isdebug()) fprintf (stderr, "Received: %s\n", data);
-
-        ParserToken json[256];
-        int jsoncount = 256;
-
-        // We need to copy to preserve the original data (JSON decoding is
-        // destructive).
-        //
-        char buffer[256];
-        safecpy (buffer, data, sizeof(buffer));
-
-        const char *error = echttp_json_parse (buffer, json, &jsoncount);
-        if (error) {
-            houselog_trace (HOUSE_FAILURE, "DEVICE", "%s: %s", error, data);
-            return;
-        }
+static void housewiz_device_process (const char *data, int length,
+                                     const struct sockaddr_in *addr,
+                                     long long now) {
 
-        // Identify the type of message.
-        // For now we only handle syncPilot and firstBeat.
-        //
-        int method = echttp_json_search (json, ".method");
-        if ((method < 0) || (json[method].type != PARSER_STRING)) {
-            houselog_trace (HOUSE_FAILURE,
-                            "DEVICE", "no valid method in: %s", data);
-            return;
-        }
-        if (strcmp (json[method].value.string, "firstBeat") &&
-            strcmp (json[method].value.string, "syncPilot")) return;
+    struct WizMessage message;
+
+    if (echttp_isdebug()) fprintf (stderr, "Received: %s\n", data);
+    WizTotals.received += 1;
+
+    uint64_t fingerprint = housewiz_device_fingerprint (data, length);
+    if (housewiz_device_unchanged (addr, fingerprint, now)) return;
+
+    const char *error = housewiz_decode (data, length, &message);
+    if (error) {
+        if (housewiz_event_allow (-1, 0, WIZ_EVENT_INVALID, -1, -1, now))
+            houselog_trace (HOUSE_FAILURE, "DEVICE", "%s in: %s", error, data);
+        WizParseFailures += 1;
+        return;
+    }
+
+    housewiz_device_apply (&message, data, addr, fingerprint, now);
+}
+
+// Apply a decoded message. The data is only used for the traces.
+//
+static void housewiz_device_apply (const struct WizMessage *message,
+                                   const char *data,
+                                   const struct sockaddr_in *addr,
+                                   uint64_t fingerprint, long long now) {
+
+    // For now we only handle syncPilot and firstBeat.
+    //
+    if (message->method == WIZ_METHOD_OTHER) {
+        WizUnknownMethods += 1;
+        return;
+    }
 
-        // Retrieve the device's MAC address (used as persistent ID)
-        //
-        int macaddr = echttp_json_search (json, ".params.mac");
-        if ((macaddr < 0) || (json[macaddr].type != PARSER_STRING)) {
+    // Retrieve the device's MAC address (used as persistent ID)
+    //
+    const char *mac = message->mac;
+    int maclength = message->maclength;
+    if (maclength >= sizeof(DeviceConfigs[0].macaddress)) {
+        if (housewiz_event_allow (-1, 0, WIZ_EVENT_INVALID, -1, -1, now))
             houselog_trace (HOUSE_FAILURE,
                             "DEVICE", "no valid MAC address in: %s", data);
-            return;
-        }
-        const char *mac = json[macaddr].value.string;
-        int device = housewiz_device_mac_search (mac);
-
-        // Record new devices.
-        //
-        if (device < 0) {
-            if (echttp_isdebug()) fprintf (stderr, "new device %s\n", mac);
-            DeviceListChanged = 1;
-            if (DevicesCount >= DevicesSpace) {
-                DevicesSpace += 32;
-                Devices = realloc (Devices, sizeof(struct DeviceMap) * DevicesSpace);
+        return;
+    }
+    int device = housewiz_device_mac_search (mac, maclength);
+
+    // Record new devices.
+    //
+    if (device < 0) {
+        if (echttp_isdebug())
+            fprintf (stderr, "new device %.*s\n", maclength, mac);
+        DeviceListChanged = 1;
+        DeviceConfigGeneration += 1;
+        if (DevicesCount >= DevicesSpace) {
+            if (!housewiz_device_grow (DevicesSpace + 32)) {
+                houselog_trace (HOUSE_FAILURE, "DEVICE", "no more memory");
+                return;
             }
-            device = DevicesCount++;
-            snprintf (Devices[device].name, sizeof(Devices[0].name), "wiz%d", device+1);
-            snprintf (Devices[device].macaddress, sizeof(Devices[0].macaddress),
-                      "%s", mac);
-            snprintf (Devices[device].description, sizeof(Devices[0].description),
-                      "autogenerated");
-            houselog_event ("DEVICE", Devices[device].name, "ADDED",
-                            "MAC ADDRESS %s", mac);
-            Devices[device].detected = now; // Skip the "DETECTED" event.
-            Devices[device].last_sense = 0;
         }
-        if (device < 0) return; // Cannot add this unknown device: ignore.
-
-        if (!Devices[device].detected)
-            houselog_event ("DEVICE", Devices[device].name, "DETECTED",
-                            "MAC ADDRESS %s", mac);
-        Devices[device].detected = now;
-
-        // Adjust to possible IP address changes.
-        //
-        memcpy (&(Devices[device].ipaddress),
-                &addr, sizeof(Devices[device].ipaddress));
-        Devices[device].ipaddress.sin_port = htons(WizDevicePort);
-
-        // Handle device reboot.
-        //
-        if (!strcmp (json[method].value.string, "firstBeat")) {
-            // Ignore repeated messages (they last for almost a minute).
-            if (Devices[device].reboot < now - 60) {
-                // This plug just rebooted, log and force a query soon.
-                int firmware = echttp_json_search (json, ".params.fwVersion");
-                if (firmware < 0) {
-                    houselog_trace (HOUSE_FAILURE, "DEVICE",
-                                    "no valid firmware version in: %s", data);
-                    return;
-                }
-                houselog_event ("DEVICE", Devices[device].name, "REBOOT",
-                                "FIRMWARE VERSION %s", json[firmware].value.string);
-                Devices[device].last_sense = now - 30; // In 5 seconds.
-                Devices[device].reboot = now;
+        device = DevicesCount++;
+        struct DeviceConfig *config = DeviceConfigs + device;
+        snprintf (config->name, sizeof(config->name), "wiz%d", device+1);
+        snprintf (config->macaddress, sizeof(config->macaddress),
+                  "%.*s", maclength, mac);
+        snprintf (config->description, sizeof(config->description),
+                  "autogenerated");
+        DeviceConfigs[device].macvalid =
+            housewiz_device_mac_binary (mac, maclength, DeviceConfigs[device].mac);
+        if (2 * DevicesCount > DeviceIndexSize)
+            housewiz_device_index_rebuild ();
+        else
+            housewiz_device_index_insert (device);
+        houselog_event ("DEVICE", DeviceConfigs[device].name, "ADDED",
+                        "MAC ADDRESS %s", DeviceConfigs[device].macaddress);
+        DeviceStates[device].detected = now; // Skip the "DETECTED" event.
+        housewiz_device_touch (device);
+        DeviceTimings[device].next_sense =
+            housewiz_device_sense_slot (now + rand() % WIZ_SENSE_PERIOD);
+        housewiz_device_schedule (device);
+    }
+    if (device < 0) return; // Cannot add this unknown device: ignore.
+    DeviceCounters[device].received += 1;
+
+    if (!DeviceStates[device].detected) {
+        if (housewiz_event_allow (device, DeviceConfigs[device].name,
+                                  WIZ_EVENT_DETECTED, -1, -1, now))
+            houselog_event ("DEVICE", DeviceConfigs[device].name, "DETECTED",
+                            "MAC ADDRESS %s", DeviceConfigs[device].macaddress);
+        housewiz_device_touch (device);
+    }
+    DeviceStates[device].detected = now;
+
+    // Adjust to possible IP address changes.
+    //
+    if (DeviceTimings[device].ipaddress.sin_addr.s_addr != addr->sin_addr.s_addr)
+        WizCacheChanged = 1;
+    memcpy (&(DeviceTimings[device].ipaddress),
+            addr, sizeof(DeviceTimings[device].ipaddress));
+    DeviceTimings[device].ipaddress.sin_port = htons(WizDevicePort);
+
+    // Handle device reboot.
+    //
+    if (message->method == WIZ_METHOD_FIRSTBEAT) {
+        // Ignore repeated messages (they last for almost a minute).
+        if ((!DeviceTimings[device].reboot) ||
+            (DeviceTimings[device].reboot < now - 60000)) {
+            // This plug just rebooted, log and force a query soon.
+            if (!message->firmware) {
+                houselog_trace (HOUSE_FAILURE, "DEVICE",
+                                "no valid firmware version in: %s", data);
+                return;
+            }
+            houselog_event ("DEVICE", DeviceConfigs[device].name, "REBOOT",
+                            "FIRMWARE VERSION %.*s",
+                            message->firmwarelength, message->firmware);
+            int length = message->firmwarelength;
+            if (length >= sizeof(DeviceTimings[device].firmware))
+                length = sizeof(DeviceTimings[device].firmware) - 1;
+            if (strncmp (DeviceTimings[device].firmware, message->firmware, length) ||
+                DeviceTimings[device].firmware[length]) {
+                memcpy (DeviceTimings[device].firmware, message->firmware, length);
+                DeviceTimings[device].firmware[length] = 0;
+                WizCacheChanged = 1;
             }
-            return;
+            DeviceTimings[device].next_sense = now + 5000;
+            DeviceTimings[device].reboot = now;
+            DeviceCounters[device].reboots += 1;
+            WizTotals.reboots += 1;
+            housewiz_device_schedule (device);
         }
+        return;
+    }
 
-        // Now the message can only be syncPilot:
-        // synchronize the device state.
-        //
-        int state = echttp_json_search (json, ".params.state");
-        if ((state < 0) || (json[state].type != PARSER_BOOL)) {
+    // Now the message can only be syncPilot:
+    // synchronize the device state.
+    //
+    if (message->state < 0) {
+        if (housewiz_event_allow (device, DeviceConfigs[device].name,
+                                  WIZ_EVENT_INVALID, -1, -1, now))
             houselog_trace (HOUSE_FAILURE,
                             "DEVICE", "no valid state in: %s", data);
-            return;
-        }
-        int status = json[state].value.bool;
+        return;
+    }
+    int status = message->state;
+    housewiz_device_update_light (device, message);
 
-        if (Devices[device].status != status) {
-            if (Devices[device].pending) {
-                if (status == Devices[device].commanded) {
-                    houselog_event ("DEVICE", Devices[device].name,
+    // Remember this message, so that the identical heartbeats that
+    // follow are recognized without decoding them.
+    //
+    DeviceTimings[device].fingerprint = fingerprint;
+    if (DeviceSenderIndex)
+        DeviceSenderIndex[housewiz_device_sender_slot (addr)] = device;
+
+    if (DeviceStates[device].status != status) {
+        if (DeviceTimings[device].pending) {
+            if (status == DeviceStates[device].commanded) {
+                if (housewiz_event_allow (device, DeviceConfigs[device].name,
+                                          WIZ_EVENT_CONFIRMED,
+                                          DeviceStates[device].status, status, now))
+                    houselog_event ("DEVICE", DeviceConfigs[device].name,
                                     "CONFIRMED", "FROM %s TO %s",
-                                    Devices[device].status?"on":"off",
+                                    DeviceStates[device].status?"on":"off",
                                     status?"on":"off");
-                    Devices[device].pending = 0; // Command complete.
+                DeviceTimings[device].pending = 0; // Command complete.
+                if (DeviceTimings[device].commandstart) {
+                    long long latency =
+                        housewiz_metrics_now() - DeviceTimings[device].commandstart;
+                    housewiz_metrics_latency
+                        (&(DeviceCounters[device].latency), latency);
+                    housewiz_metrics_latency (&(WizTotals.latency), latency);
+                    if (!DeviceTimings[device].attempts)
+                        housewiz_device_rtt (device, latency);
+                    DeviceTimings[device].commandstart = 0;
                 }
-            } else {
-                houselog_event ("DEVICE", Devices[device].name,
+            }
+        } else {
+            if (housewiz_event_allow (device, DeviceConfigs[device].name,
+                                      WIZ_EVENT_CHANGED,
+                                      DeviceStates[device].status, status, now))
+                houselog_event ("DEVICE", DeviceConfigs[device].name,
                                 "CHANGED", "FROM %s TO %s",
-                                Devices[device].status?"on":"off",
+                                DeviceStates[device].status?"on":"off",
                                 status?"on":"off");
-                Devices[device].commanded = status; // By someone else.
+            DeviceStates[device].commanded = status; // By someone else.
+        }
+        DeviceStates[device].status = status;
+        WizCacheChanged = 1;
+        housewiz_device_touch (device);
+    }
+}
+
+// Apply a message decoded by a receive worker.
+//
+static void housewiz_device_update (const struct WizUpdate *update,
+                                    long long now) {
+
+    struct WizMessage message;
+
+    if (echttp_isdebug()) fprintf (stderr, "Received: %s\n", update->excerpt);
+    WizTotals.received += 1;
+
+    if (housewiz_device_unchanged (&(update->addr), update->fingerprint, now))
+        return;
+
+    if (update->error[0]) {
+        if (housewiz_event_allow (-1, 0, WIZ_EVENT_INVALID, -1, -1, now))
+            houselog_trace (HOUSE_FAILURE, "DEVICE", "%s in: %s",
+                            update->error, update->excerpt);
+        WizParseFailures += 1;
+        return;
+    }
+    housewiz_pipeline_message (update, &message);
+    housewiz_device_apply (&message, update->excerpt, &(update->addr),
+                           update->fingerprint, now);
+}
+
+static void housewiz_device_receive (int fd, int mode) {
+
+    static char data[WIZ_RECEIVE_BATCH][WIZ_PACKET_MAX];
+    static struct sockaddr_in addr[WIZ_RECEIVE_BATCH];
+    static struct iovec iov[WIZ_RECEIVE_BATCH];
+    static union {
+        char buffer[CMSG_SPACE(sizeof(uint32_t))];
+        struct cmsghdr align;
+    } control[WIZ_RECEIVE_BATCH];
+    static struct mmsghdr msg[WIZ_RECEIVE_BATCH];
+
+    long long start = housewiz_metrics_start ();
+    long long now = housewiz_metrics_now();
+    int total = 0;
+    int i;
+
+    // Each socket has its own count of dropped packets.
+    uint32_t *dropped = &WizReceiveDropped;
+    for (i = 0; i < NetworksCount; i++) {
+        if (Networks[i].socket == fd) dropped = &(Networks[i].dropped);
+    }
+
+    // Drain the socket, but leave some room for the other I/Os if the
+    // network is very active.
+    //
+    while (total < WizReceivePerWakeup) {
+
+        int batch = WizReceivePerWakeup - total;
+        if (batch > WIZ_RECEIVE_BATCH) batch = WIZ_RECEIVE_BATCH;
+
+        for (i = 0; i < batch; ++i) {
+            iov[i].iov_base = data[i];
+            iov[i].iov_len = WIZ_PACKET_MAX - 1; // Room for a terminator.
+            msg[i].msg_hdr.msg_name = addr + i;
+            msg[i].msg_hdr.msg_namelen = sizeof(addr[0]);
+            msg[i].msg_hdr.msg_iov = iov + i;
+            msg[i].msg_hdr.msg_iovlen = 1;
+            msg[i].msg_hdr.msg_control = control[i].buffer;
+            msg[i].msg_hdr.msg_controllen = sizeof(control[0].buffer);
+            msg[i].msg_hdr.msg_flags = 0;
+            msg[i].msg_len = 0;
+        }
+
+        int count = recvmmsg (fd, msg, batch, MSG_DONTWAIT, 0);
+        if (count <= 0) {
+            if ((count < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+                houselog_trace (HOUSE_FAILURE, "DEVICE",
+                                "recvmmsg() error: %s", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < count; ++i) {
+            struct cmsghdr *cmsg;
+            for (cmsg = CMSG_FIRSTHDR(&(msg[i].msg_hdr)); cmsg;
+                 cmsg = CMSG_NXTHDR(&(msg[i].msg_hdr), cmsg)) {
+                // The kernel reports its own count of dropped packets.
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SO_RXQ_OVFL) {
+                    memcpy (dropped, CMSG_DATA(cmsg), sizeof(*dropped));
+                }
             }
-            Devices[device].status = status;
+            if (msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                WizReceiveTruncated += 1;
+                continue;
+            }
+            int size = msg[i].msg_len;
+            if (size <= 0) continue;
+            data[i][size] = 0;
+            housewiz_device_process (data[i], size, addr + i, now);
+        }
+        total += count;
+        if (count < batch) break; // The socket is now empty.
+    }
+    housewiz_metrics_stop (WIZ_PROBE_RECEIVE, start);
+}
+
+unsigned long housewiz_device_dropped (void) {
+    int i;
+    unsigned long dropped = WizReceiveDropped + WizReceiveDroppedClosed;
+    dropped += housewiz_pipeline_dropped ();
+    for (i = 0; i < NetworksCount; i++) dropped += Networks[i].dropped;
+    return dropped + WizReceiveTruncated;
+}
+
+void housewiz_device_metrics_json (struct WizJson *json) {
+
+    int i;
+
+    housewiz_json_integer (json, "dropped", housewiz_device_dropped());
+    housewiz_json_integer (json, "parsefailures", WizParseFailures);
+    housewiz_json_integer (json, "unknownmethods", WizUnknownMethods);
+    housewiz_json_integer (json, "unchanged", WizHeartbeatsUnchanged);
+
+    housewiz_json_array (json, "bounds");
+    for (i = 0; i < WIZ_LATENCY_BUCKETS; ++i)
+        housewiz_json_integer (json, 0, 1LL << i);
+    housewiz_json_end (json);
+
+    housewiz_json_object (json, "total");
+    housewiz_metrics_json (json, &WizTotals);
+    housewiz_json_end (json);
+
+    housewiz_json_object (json, "devices");
+    for (i = 0; i < DevicesCount; ++i) {
+        housewiz_json_object (json, DeviceConfigs[i].name);
+        housewiz_metrics_json (json, DeviceCounters + i);
+        if (DeviceTimings[i].srtt) {
+            housewiz_json_integer (json, "srtt", DeviceTimings[i].srtt);
+            housewiz_json_integer (json, "rttvar", DeviceTimings[i].rttvar);
         }
+        housewiz_json_end (json);
     }
+    housewiz_json_end (json);
+}
+
+int housewiz_device_metrics_text (char *buffer, int size) {
+
+    static const struct {
+        const char *name;
+        int offset;
+    } families[] = {
+        {"wiz_device_commands_sent_total",
+             offsetof(struct WizCounters, sent)},
+        {"wiz_device_retries_total",
+             offsetof(struct WizCounters, retries)},
+        {"wiz_device_timeouts_total",
+             offsetof(struct WizCounters, timeouts)},
+        {"wiz_device_received_total",
+             offsetof(struct WizCounters, received)},
+        {"wiz_device_reboots_total",
+             offsetof(struct WizCounters, reboots)},
+        {0, 0}
+    };
+    struct WizMetricsText text = {buffer, size, 0};
+    int f;
+    int i;
+
+    if (size > 0) buffer[0] = 0;
+
+    housewiz_metrics_type (&text, "wiz_packets_received_total", "counter");
+    housewiz_metrics_value (&text, "wiz_packets_received_total", 0, WizTotals.received);
+    housewiz_metrics_type (&text, "wiz_packets_dropped_total", "counter");
+    housewiz_metrics_value (&text, "wiz_packets_dropped_total", 0, housewiz_device_dropped());
+    housewiz_metrics_type (&text, "wiz_parse_failures_total", "counter");
+    housewiz_metrics_value (&text, "wiz_parse_failures_total", 0, WizParseFailures);
+    housewiz_metrics_type (&text, "wiz_unknown_methods_total", "counter");
+    housewiz_metrics_value (&text, "wiz_unknown_methods_total", 0, WizUnknownMethods);
+    housewiz_metrics_type (&text, "wiz_unchanged_heartbeats_total", "counter");
+    housewiz_metrics_value (&text, "wiz_unchanged_heartbeats_total", 0, WizHeartbeatsUnchanged);
+    housewiz_metrics_type (&text, "wiz_commands_sent_total", "counter");
+    housewiz_metrics_value (&text, "wiz_commands_sent_total", 0, WizTotals.sent);
+    housewiz_metrics_type (&text, "wiz_retries_total", "counter");
+    housewiz_metrics_value (&text, "wiz_retries_total", 0, WizTotals.retries);
+    housewiz_metrics_type (&text, "wiz_timeouts_total", "counter");
+    housewiz_metrics_value (&text, "wiz_timeouts_total", 0, WizTotals.timeouts);
+    housewiz_metrics_type (&text, "wiz_reboots_total", "counter");
+    housewiz_metrics_value (&text, "wiz_reboots_total", 0, WizTotals.reboots);
+    housewiz_metrics_type (&text, "wiz_command_latency_ms", "histogram");
+    housewiz_metrics_histogram (&text, "wiz_command_latency_ms", 0, &WizTotals.latency);
+
+    for (f = 0; families[f].name; ++f) {
+        housewiz_metrics_type (&text, families[f].name, "counter");
+        for (i = 0; i < DevicesCount; ++i) {
+            const char *counters = (const char *)(DeviceCounters + i);
+            housewiz_metrics_value
+                (&text, families[f].name, DeviceConfigs[i].name,
+                 *((const unsigned long *)(counters + families[f].offset)));
+        }
+    }
+    housewiz_metrics_type (&text, "wiz_device_command_latency_ms", "histogram");
+    for (i = 0; i < DevicesCount; ++i)
+        housewiz_metrics_histogram (&text, "wiz_device_command_latency_ms",
+                                    DeviceConfigs[i].name,
+                                    &(DeviceCounters[i].latency));
+    housewiz_metrics_type (&text, "wiz_device_srtt_ms", "gauge");
+    for (i = 0; i < DevicesCount; ++i) {
+        if (!DeviceTimings[i].srtt) continue;
+        housewiz_metrics_value (&text, "wiz_device_srtt_ms",
+                                DeviceConfigs[i].name, DeviceTimings[i].srtt);
+    }
+    return text.length;
 }
 
 const char *housewiz_device_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    DeviceEpoch = time(0);
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-wiz-rcvbuf=", argv[i], &value)) {
+            WizReceiveBuffer = atoi(value);
+        } else if (echttp_option_match ("-wiz-rcvmax=", argv[i], &value)) {
+            WizReceivePerWakeup = atoi(value);
+            if (WizReceivePerWakeup <= 0) WizReceivePerWakeup = 1;
+        } else if (echttp_option_match ("-wiz-sense-rate=", argv[i], &value)) {
+            WizSenseRate = atoi(value);
+        } else if (echttp_option_match ("-wiz-receive-threads=", argv[i], &value)) {
+            WizReceiveThreads = atoi(value);
+            if (WizReceiveThreads < 0) WizReceiveThreads = 0;
+        } else if (echttp_option_match ("-wiz-interfaces=", argv[i], &value)) {
+            safecpy (WizInterfaces, value, sizeof(WizInterfaces));
+            WizInterfaceSockets = strcmp (WizInterfaces, "none");
+        }
+    }
+
+    srand (time(0) ^ getpid());
+    housewiz_event_initialize (argc, argv);
+    housewiz_queue_initialize (argc, argv);
+    if (WizReceiveThreads > 0) {
+        WizReceiveThreads =
+            housewiz_pipeline_start (WizReceiveThreads, WizStatusPort,
+                                     WizReceiveBuffer, WizReceivePerWakeup,
+                                     housewiz_device_update);
+    }
     housewiz_device_socket ();
-    echttp_listen (WizSocket, 1, housewiz_device_receive, 0);
-    return housewiz_device_refresh ("AT STARTUP");
+    housewiz_device_listen (WizSocket);
+    housewiz_device_netlink_open ();
+    housewiz_device_enumerate ();
+
+    WizTimer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (WizTimer >= 0) {
+        echttp_listen (WizTimer, 1, housewiz_device_timer, 0);
+    } else {
+        houselog_trace (HOUSE_FAILURE, "TIMER",
+                        "timerfd_create() error: %s", strerror(errno));
+    }
+    const char *error = housewiz_device_refresh ("AT STARTUP");
+
+    // Warm start: query the devices known from the previous run, and
+    // look for the others, without waiting for the periodic discovery.
+    //
+    housewiz_cache_initialize (argc, argv);
+    int restored = housewiz_cache_load (housewiz_device_restore);
+    if (restored > 0)
+        houselog_event ("SERVICE", "wiz", "RESTORED", "%d DEVICES", restored);
+    housewiz_device_discover ();
+    return error;
 }
 
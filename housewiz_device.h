@@ -25,18 +25,59 @@ const char *housewiz_device_initialize (int argc, const char **argv);
 const char *housewiz_device_refresh (const char *reason);
 
 int housewiz_device_changed (void);
+long housewiz_device_generation (void);
+long housewiz_device_config_generation (void);
+
+long housewiz_device_stamp (int point);
+time_t housewiz_device_epoch (void);
+int  housewiz_device_delta_valid (time_t epoch, long since);
+const char *housewiz_device_removed (long since, int *cursor);
 
 int housewiz_device_count (void);
 const char *housewiz_device_name (int point);
+int housewiz_device_find (const char *name);
 
-const char *housewiz_device_live_config (char *buffer, int size);
+const char *housewiz_device_live_config (const char **error);
 
 const char *housewiz_device_failure (int point);
 
+struct WizLight { // As last reported by the device, 0 if not reported.
+    short dimming;
+    short temp;
+    signed char rssi;
+    unsigned char scene;
+    unsigned char color; // 1 if red, green and blue were reported.
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+};
+
+const struct WizLight *housewiz_device_light (int point);
+
 int    housewiz_device_commanded (int point);
 time_t housewiz_device_deadline  (int point);
 int    housewiz_device_get       (int point);
 int    housewiz_device_set       (int point, int state, int pulse);
 
-void housewiz_device_periodic (time_t now);
+struct WizPilot {
+    int state;
+    int dimming; // 10 to 100 (%), 0 if not specified.
+    int temp;    // 2200 to 6500 (Kelvin), 0 if not specified.
+    int scene;   // 1 to 32, 0 if not specified.
+    int color;   // 1 if red, green and blue are specified.
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+};
+
+const char *housewiz_device_pilot_check (const struct WizPilot *pilot);
+int housewiz_device_pilot (int point, const struct WizPilot *pilot, int pulse);
+
+unsigned long housewiz_device_dropped (void);
+
+struct WizJson;
+void housewiz_device_metrics_json (struct WizJson *json);
+int  housewiz_device_metrics_text (char *buffer, int size);
+
+void housewiz_device_periodic (long long now);
 
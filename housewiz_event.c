@@ -0,0 +1,293 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_event.c - Limit the rate of the repeated device events.
+ *
+ * SYNOPSYS:
+ *
+ * A failing network causes the same events to be repeated for many
+ * devices (retries, timeouts, silent devices, invalid messages). Each
+ * event costs a formatting, storage and eventually a push to the log
+ * service. This module limits how many events of each type are logged
+ * per device: only the first few in each one minute window, the rest
+ * being summarized at the end of the window ("RETRY x37 IN 60s").
+ *
+ * All events, logged or not, are also recorded, unformatted, in a fixed
+ * size ring of recent events. Formatting happens only when a client asks
+ * for the recent events.
+ *
+ * void housewiz_event_initialize (int argc, const char **argv);
+ *
+ *    Set the number of events of the same type logged per device in each
+ *    window (option -wiz-event-burst=N, default 3, 0 means no limit).
+ *
+ * int housewiz_event_allow (int device, const char *name,
+ *                           int type, int from, int to, long long now);
+ *
+ *    Record one event, and return 1 if the event must be logged or 0 if it
+ *    was suppressed. The device is an index, or -1 for the events that are
+ *    not attributed to any device. The from and to states are only used
+ *    to describe the event in the ring, and can be -1. The time is
+ *    monotonic, in milliseconds.
+ *
+ * void housewiz_event_periodic (long long now);
+ *
+ *    Log the summary of the windows that ended. Only the windows with
+ *    suppressed events are visited.
+ *
+ * void housewiz_event_reset (void);
+ *
+ *    Log the pending summaries and forget all windows. This must be called
+ *    before the device indexes change.
+ *
+ * const char *housewiz_event_recent (long since, const char **error);
+ *
+ *    Return the recent events in JSON, only the ones recorded after the
+ *    specified sequence number if not 0. The result is valid until the
+ *    next call.
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housewiz_device.h"
+#include "housewiz_json.h"
+#include "housewiz_metrics.h"
+#include "housewiz_event.h"
+
+#define WIZ_EVENT_WINDOW 60000 // Milliseconds.
+#define WIZ_EVENT_RING   1024  // Must be a power of 2.
+
+static const char *EventActions[WIZ_EVENT_TYPES] = {
+    "DETECTED", "SILENT", "CHANGED", "CONFIRMED", "RETRY", "TIMEOUT", "INVALID"
+};
+
+static int EventBurst = 3;
+
+// The window of each device for each event type. The first row is for
+// the events that are not attributed to any device.
+//
+struct EventWindow {
+    long long start;
+    unsigned short count;
+    unsigned short suppressed;
+    int listed; // Non-zero if in the list of pending summaries.
+};
+
+static struct EventWindow *EventWindows = 0;
+static int EventWindowsSpace = 0;
+
+static int *EventPending = 0;
+static int EventPendingCount = 0;
+static int EventPendingSpace = 0;
+
+struct EventRecord {
+    long long time; // Monotonic, milliseconds.
+    char name[32];
+    unsigned char type;
+    signed char from;
+    signed char to;
+    unsigned char logged;
+};
+
+static struct EventRecord EventRing[WIZ_EVENT_RING];
+static long EventRecorded = 0; // Sequence number of the last record.
+
+
+void housewiz_event_initialize (int argc, const char **argv) {
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-wiz-event-burst=", argv[i], &value))
+            EventBurst = atoi(value);
+    }
+}
+
+static void housewiz_event_record (const char *name, int type,
+                                   int from, int to, int logged,
+                                   long long now) {
+
+    struct EventRecord *record =
+        EventRing + ((EventRecorded + 1) & (WIZ_EVENT_RING - 1));
+    int length = name ? strnlen (name, sizeof(record->name) - 1) : 0;
+
+    record->time = now;
+    if (length) memcpy (record->name, name, length);
+    record->name[length] = 0;
+    record->type = type;
+    record->from = from;
+    record->to = to;
+    record->logged = logged;
+    EventRecorded += 1;
+}
+
+static void housewiz_event_summary (int slot, long long now) {
+
+    struct EventWindow *window = EventWindows + slot;
+    int device = slot / WIZ_EVENT_TYPES - 1;
+    const char *action = EventActions[slot % WIZ_EVENT_TYPES];
+    int seconds = (int)((now - window->start + 500) / 1000);
+
+    if (device >= 0) {
+        const char *name = housewiz_device_name (device);
+        houselog_event ("DEVICE", name ? name : "unknown", action,
+                        "x%u IN %ds", (unsigned)window->suppressed, seconds);
+    } else {
+        houselog_trace (HOUSE_FAILURE, "DEVICE", "%s x%u IN %ds",
+                        action, (unsigned)window->suppressed, seconds);
+    }
+    window->suppressed = 0;
+}
+
+static struct EventWindow *housewiz_event_window (int slot) {
+
+    if (slot >= EventWindowsSpace) {
+        int space = EventWindowsSpace ? EventWindowsSpace : 256;
+        while (space <= slot) space *= 2;
+        struct EventWindow *windows =
+            realloc (EventWindows, space * sizeof(struct EventWindow));
+        if (!windows) return 0;
+        memset (windows + EventWindowsSpace, 0,
+                (space - EventWindowsSpace) * sizeof(struct EventWindow));
+        EventWindows = windows;
+        EventWindowsSpace = space;
+    }
+    return EventWindows + slot;
+}
+
+static void housewiz_event_list (int slot) {
+
+    if (EventWindows[slot].listed) return;
+    if (EventPendingCount >= EventPendingSpace) {
+        int space = EventPendingSpace ? 2 * EventPendingSpace : 64;
+        int *pending = realloc (EventPending, space * sizeof(int));
+        if (!pending) return; // The summary will come with the next event.
+        EventPending = pending;
+        EventPendingSpace = space;
+    }
+    EventPending[EventPendingCount++] = slot;
+    EventWindows[slot].listed = 1;
+}
+
+int housewiz_event_allow (int device, const char *name,
+                          int type, int from, int to, long long now) {
+
+    if ((type < 0) || (type >= WIZ_EVENT_TYPES)) return 1;
+    if (device < -1) device = -1;
+
+    int slot = (device + 1) * WIZ_EVENT_TYPES + type;
+    struct EventWindow *window =
+        (EventBurst > 0) ? housewiz_event_window (slot) : 0;
+    if (!window) {
+        housewiz_event_record (name, type, from, to, 1, now);
+        return 1;
+    }
+
+    if ((!window->start) || (now >= window->start + WIZ_EVENT_WINDOW)) {
+        if (window->suppressed) housewiz_event_summary (slot, now);
+        window->start = now;
+        window->count = 0;
+    }
+    if (window->count < EventBurst) {
+        window->count += 1;
+        housewiz_event_record (name, type, from, to, 1, now);
+        return 1;
+    }
+    if (window->suppressed < 0xffff) window->suppressed += 1;
+    housewiz_event_list (slot);
+    housewiz_event_record (name, type, from, to, 0, now);
+    return 0;
+}
+
+void housewiz_event_periodic (long long now) {
+
+    int i = 0;
+    while (i < EventPendingCount) {
+        int slot = EventPending[i];
+        struct EventWindow *window = EventWindows + slot;
+        if (window->suppressed && (now < window->start + WIZ_EVENT_WINDOW)) {
+            i += 1;
+            continue;
+        }
+        if (window->suppressed) housewiz_event_summary (slot, now);
+        window->listed = 0;
+        EventPending[i] = EventPending[--EventPendingCount];
+    }
+}
+
+void housewiz_event_reset (void) {
+
+    int i;
+    long long now = housewiz_metrics_now();
+
+    for (i = 0; i < EventPendingCount; ++i) {
+        if (EventWindows[EventPending[i]].suppressed)
+            housewiz_event_summary (EventPending[i], now);
+    }
+    EventPendingCount = 0;
+    if (EventWindows)
+        memset (EventWindows, 0, EventWindowsSpace * sizeof(struct EventWindow));
+}
+
+const char *housewiz_event_recent (long since, const char **error) {
+
+    static struct WizJson json;
+    long long now = housewiz_metrics_now();
+    long long wallclock = (long long)time(0) * 1000;
+    long first = EventRecorded - WIZ_EVENT_RING + 1;
+    long i;
+
+    if (first < 1) first = 1;
+    if (since >= first) first = since + 1;
+
+    housewiz_json_start (&json);
+    housewiz_json_object (&json, 0);
+    housewiz_json_string (&json, "host", houselog_host());
+    housewiz_json_integer (&json, "timestamp", (long long)time(0));
+    housewiz_json_integer (&json, "latest", EventRecorded);
+    housewiz_json_array (&json, "recent");
+
+    for (i = EventRecorded; i >= first; --i) {
+        const struct EventRecord *record = EventRing + (i & (WIZ_EVENT_RING - 1));
+        char description[32];
+        description[0] = 0;
+        if ((record->from >= 0) && (record->to >= 0))
+            snprintf (description, sizeof(description), "FROM %s TO %s",
+                      record->from ? "on" : "off", record->to ? "on" : "off");
+        else if (record->to >= 0)
+            snprintf (description, sizeof(description), "%s",
+                      record->to ? "on" : "off");
+
+        housewiz_json_object (&json, 0);
+        housewiz_json_integer (&json, "time", wallclock + (record->time - now));
+        housewiz_json_string (&json, "name", record->name);
+        housewiz_json_string (&json, "action", EventActions[record->type]);
+        housewiz_json_string (&json, "description", description);
+        if (!record->logged) housewiz_json_bool (&json, "suppressed", 1);
+        housewiz_json_end (&json);
+    }
+    return housewiz_json_export (&json, error);
+}
@@ -0,0 +1,41 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_event.h - Limit the rate of the repeated device events.
+ *
+ */
+#define WIZ_EVENT_DETECTED  0
+#define WIZ_EVENT_SILENT    1
+#define WIZ_EVENT_CHANGED   2
+#define WIZ_EVENT_CONFIRMED 3
+#define WIZ_EVENT_RETRY     4
+#define WIZ_EVENT_TIMEOUT   5
+#define WIZ_EVENT_INVALID   6 // A message that could not be used.
+#define WIZ_EVENT_TYPES     7
+
+void housewiz_event_initialize (int argc, const char **argv);
+
+int  housewiz_event_allow (int device, const char *name,
+                           int type, int from, int to, long long now);
+
+void housewiz_event_periodic (long long now);
+void housewiz_event_reset (void);
+
+const char *housewiz_event_recent (long since, const char **error);
@@ -0,0 +1,229 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housewiz_group.c - Named groups of devices.
+ *
+ * SYNOPSYS:
+ *
+ * A group is a named list of devices, defined in the configuration as
+ * the wiz.groups array, e.g.:
+ *
+ *    "groups" : [{"name" : "kitchen", "devices" : ["light1", "light2"]}]
+ *
+ * A command sent to a group is sent to all its devices at once.
+ *
+ * int housewiz_group_refresh (void);
+ *
+ *    Load the groups from the current configuration. Return 1 if the
+ *    groups changed, 0 otherwise.
+ *
+ * int housewiz_group_find (const char *name);
+ *
+ *    Return the index of the named group, or -1 if not found.
+ *
+ * int housewiz_group_members (int group, const int **devices);
+ *
+ *    Return the number of configured devices in the group, and their
+ *    indexes. The names that do not match a device are ignored. The list
+ *    is valid until the configuration changes.
+ *
+ * void housewiz_group_live_config (struct WizJson *json);
+ *
+ *    Add the groups, if any, to the live configuration.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houseconfig.h"
+
+#include "housewiz_device.h"
+#include "housewiz_json.h"
+#include "housewiz_group.h"
+
+#define WIZ_GROUP_NAME 32
+
+struct WizGroup {
+    char name[WIZ_GROUP_NAME];
+    int first;    // Index of the first member in GroupMembers.
+    int count;    // Number of members, as configured.
+    int resolved; // Number of members that are known devices.
+};
+
+static struct WizGroup *Groups = 0;
+static int GroupsCount = 0;
+
+// The members of all groups, in order. The device indexes are resolved
+// again from the names every time the device configuration changes.
+//
+static char (*GroupMembers)[WIZ_GROUP_NAME] = 0;
+static int *GroupDevices = 0;
+static int GroupMembersCount = 0;
+
+static long GroupResolved = -1; // The device config generation resolved.
+
+
+static void safecpy (char *dest, const char *src, int limit) {
+    strncpy (dest, src, limit-1);
+    dest[limit-1] = 0;
+}
+
+static int housewiz_group_same (const struct WizGroup *groups, int count,
+                                char (*members)[WIZ_GROUP_NAME], int total) {
+    int i;
+    if ((count != GroupsCount) || (total != GroupMembersCount)) return 0;
+    for (i = 0; i < count; ++i) {
+        if (strcmp (groups[i].name, Groups[i].name)) return 0;
+        if (groups[i].count != Groups[i].count) return 0;
+    }
+    for (i = 0; i < total; ++i) {
+        if (strcmp (members[i], GroupMembers[i])) return 0;
+    }
+    return 1;
+}
+
+int housewiz_group_refresh (void) {
+
+    int i;
+    int j;
+    int groups = -1;
+    int count = 0;
+    int total = 0;
+    char path[32];
+
+    if (houseconfig_active()) {
+        groups = houseconfig_array (0, ".wiz.groups");
+        if (groups >= 0) count = houseconfig_array_length (groups);
+        if (count < 0) count = 0;
+    }
+
+    // Count the members first, so that the lists are allocated once.
+    //
+    for (i = 0; i < count; ++i) {
+        snprintf (path, sizeof(path), "[%d]", i);
+        int group = houseconfig_object (groups, path);
+        if (group < 0) continue;
+        int list = houseconfig_array (group, ".devices");
+        if (list >= 0) total += houseconfig_array_length (list);
+    }
+
+    struct WizGroup *newgroups = calloc (count + 1, sizeof(struct WizGroup));
+    char (*newmembers)[WIZ_GROUP_NAME] = calloc (total + 1, WIZ_GROUP_NAME);
+    int *newdevices = calloc (total + 1, sizeof(int));
+    if ((!newgroups) || (!newmembers) || (!newdevices)) {
+        free (newgroups);
+        free (newmembers);
+        free (newdevices);
+        return 0;
+    }
+
+    int added = 0;
+    int members = 0;
+    for (i = 0; i < count; ++i) {
+        snprintf (path, sizeof(path), "[%d]", i);
+        int group = houseconfig_object (groups, path);
+        if (group < 0) continue;
+        const char *name = houseconfig_string (group, ".name");
+        if ((!name) || (!name[0])) continue;
+
+        struct WizGroup *g = newgroups + added++;
+        safecpy (g->name, name, sizeof(g->name));
+        g->first = members;
+
+        int list = houseconfig_array (group, ".devices");
+        int length = (list >= 0) ? houseconfig_array_length (list) : 0;
+        for (j = 0; (j < length) && (members < total); ++j) {
+            snprintf (path, sizeof(path), "[%d]", j);
+            const char *device = houseconfig_string (list, path);
+            if ((!device) || (!device[0])) continue;
+            safecpy (newmembers[members++], device, WIZ_GROUP_NAME);
+        }
+        g->count = members - g->first;
+    }
+
+    if (housewiz_group_same (newgroups, added, newmembers, members)) {
+        free (newgroups);
+        free (newmembers);
+        free (newdevices);
+        return 0;
+    }
+    free (Groups);
+    free (GroupMembers);
+    free (GroupDevices);
+    Groups = newgroups;
+    GroupsCount = added;
+    GroupMembers = newmembers;
+    GroupDevices = newdevices;
+    GroupMembersCount = members;
+    GroupResolved = -1;
+    return 1;
+}
+
+int housewiz_group_find (const char *name) {
+    int i;
+    for (i = 0; i < GroupsCount; ++i) {
+        if (!strcmp (name, Groups[i].name)) return i;
+    }
+    return -1;
+}
+
+static void housewiz_group_resolve (void) {
+    int i;
+    int j;
+    for (i = 0; i < GroupsCount; ++i) {
+        struct WizGroup *g = Groups + i;
+        int *devices = GroupDevices + g->first;
+        g->resolved = 0;
+        for (j = 0; j < g->count; ++j) {
+            int device = housewiz_device_find (GroupMembers[g->first + j]);
+            if (device >= 0) devices[g->resolved++] = device;
+        }
+    }
+    GroupResolved = housewiz_device_config_generation ();
+}
+
+int housewiz_group_members (int group, const int **devices) {
+    if ((group < 0) || (group >= GroupsCount)) return 0;
+    if (GroupResolved != housewiz_device_config_generation ())
+        housewiz_group_resolve ();
+    *devices = GroupDevices + Groups[group].first;
+    return Groups[group].resolved;
+}
+
+void housewiz_group_live_config (struct WizJson *json) {
+    int i;
+    int j;
+    if (GroupsCount <= 0) return;
+    housewiz_json_array (json, "groups");
+    for (i = 0; i < GroupsCount; ++i) {
+        housewiz_json_object (json, 0);
+        housewiz_json_string (json, "name", Groups[i].name);
+        housewiz_json_array (json, "devices");
+        for (j = 0; j < Groups[i].count; ++j)
+            housewiz_json_string (json, 0, GroupMembers[Groups[i].first + j]);
+        housewiz_json_end (json);
+        housewiz_json_end (json);
+    }
+    housewiz_json_end (json);
+}
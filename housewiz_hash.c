@@ -0,0 +1,62 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_hash.c - The FNV-1a hash functions shared by all modules.
+ *
+ * SYNOPSYS:
+ *
+ * These hashes are fast and good enough for hash tables and for
+ * recognizing a repeated message. They are not cryptographic.
+ *
+ * unsigned int housewiz_hash (const void *data, int length);
+ *
+ *    Return the 32 bits FNV-1a hash of the data.
+ *
+ * uint64_t housewiz_hash64 (const void *data, int length);
+ *
+ *    Return the 64 bits FNV-1a hash of the data, for when a collision
+ *    would go unnoticed.
+ */
+
+#include <stdint.h>
+
+#include "housewiz_hash.h"
+
+unsigned int housewiz_hash (const void *data, int length) {
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < length; ++i) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint64_t housewiz_hash64 (const void *data, int length) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t hash = 14695981039346656037ull;
+    int i;
+    for (i = 0; i < length; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
@@ -0,0 +1,196 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_json.c - A streaming JSON writer with a growing buffer.
+ *
+ * SYNOPSYS:
+ *
+ * This module writes JSON text directly into a buffer, without building
+ * a token list first. There is no limit on the number of items: the
+ * buffer grows as needed, and is reused for the next document, so that
+ * no memory is allocated once the buffer reached its high-water mark.
+ *
+ * void housewiz_json_start (struct WizJson *json);
+ *
+ *    Start a new document, reusing the buffer from the previous one.
+ *    The structure must be initialized to zeroes before the first use.
+ *
+ * void housewiz_json_object (struct WizJson *json, const char *key);
+ * void housewiz_json_array  (struct WizJson *json, const char *key);
+ * void housewiz_json_end    (struct WizJson *json);
+ *
+ *    Open, or close, an object or an array. The key must be a null pointer
+ *    for the root item, or for an item within an array.
+ *
+ * void housewiz_json_string  (struct WizJson *json,
+ *                             const char *key, const char *value);
+ * void housewiz_json_integer (struct WizJson *json,
+ *                             const char *key, long long value);
+ * void housewiz_json_bool    (struct WizJson *json,
+ *                             const char *key, int value);
+ *
+ *    Add one value to the current object or array.
+ *
+ * const char *housewiz_json_export (struct WizJson *json,
+ *                                   const char **error);
+ *
+ *    Complete the document and return its text, or a null pointer if
+ *    an error occurred while writing it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "housewiz_json.h"
+
+
+static int housewiz_json_room (struct WizJson *json, int needed) {
+
+    if (json->error) return 0;
+    needed += json->length + 1; // Always keep room for a terminator.
+    if (needed <= json->size) return 1;
+
+    int size = json->size ? json->size : 4096;
+    while (size < needed) size *= 2;
+    char *buffer = realloc (json->buffer, size);
+    if (!buffer) {
+        json->error = "no more memory";
+        return 0;
+    }
+    json->buffer = buffer;
+    json->size = size;
+    return 1;
+}
+
+static void housewiz_json_raw (struct WizJson *json,
+                               const char *text, int length) {
+    if (!housewiz_json_room (json, length)) return;
+    memcpy (json->buffer + json->length, text, length);
+    json->length += length;
+}
+
+static void housewiz_json_quoted (struct WizJson *json, const char *text) {
+
+    static const char hex[] = "0123456789abcdef";
+    const char *start = text;
+
+    housewiz_json_raw (json, "\"", 1);
+    for (; *text; ++text) {
+        unsigned char c = *text;
+        if ((c >= 0x20) && (c != '"') && (c != '\\')) continue;
+
+        housewiz_json_raw (json, start, text - start);
+        switch (c) {
+            case '"':  housewiz_json_raw (json, "\\\"", 2); break;
+            case '\\': housewiz_json_raw (json, "\\\\", 2); break;
+            case '\n': housewiz_json_raw (json, "\\n", 2); break;
+            case '\r': housewiz_json_raw (json, "\\r", 2); break;
+            case '\t': housewiz_json_raw (json, "\\t", 2); break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                housewiz_json_raw (json, escape, 6);
+            }
+        }
+        start = text + 1;
+    }
+    housewiz_json_raw (json, start, text - start);
+    housewiz_json_raw (json, "\"", 1);
+}
+
+// Add the separator and key that precede a new item.
+//
+static void housewiz_json_key (struct WizJson *json, const char *key) {
+    if (json->depth > 0) {
+        if (json->count[json->depth-1]++ > 0) housewiz_json_raw (json, ",", 1);
+    }
+    if (key) {
+        housewiz_json_quoted (json, key);
+        housewiz_json_raw (json, ":", 1);
+    }
+}
+
+static void housewiz_json_open (struct WizJson *json,
+                                const char *key, char type) {
+    if (json->depth >= WIZ_JSON_DEPTH) {
+        json->error = "too deep";
+        return;
+    }
+    housewiz_json_key (json, key);
+    housewiz_json_raw (json, &type, 1);
+    json->type[json->depth] = (type == '{') ? '}' : ']';
+    json->count[json->depth++] = 0;
+}
+
+void housewiz_json_start (struct WizJson *json) {
+    json->length = 0;
+    json->depth = 0;
+    json->error = 0;
+}
+
+void housewiz_json_object (struct WizJson *json, const char *key) {
+    housewiz_json_open (json, key, '{');
+}
+
+void housewiz_json_array (struct WizJson *json, const char *key) {
+    housewiz_json_open (json, key, '[');
+}
+
+void housewiz_json_end (struct WizJson *json) {
+    if (json->depth <= 0) {
+        json->error = "unbalanced end";
+        return;
+    }
+    json->depth -= 1;
+    housewiz_json_raw (json, json->type + json->depth, 1);
+}
+
+void housewiz_json_string (struct WizJson *json,
+                           const char *key, const char *value) {
+    housewiz_json_key (json, key);
+    if (value) housewiz_json_quoted (json, value);
+    else       housewiz_json_raw (json, "null", 4);
+}
+
+void housewiz_json_integer (struct WizJson *json,
+                            const char *key, long long value) {
+    char ascii[32];
+    housewiz_json_key (json, key);
+    housewiz_json_raw (json, ascii, snprintf (ascii, sizeof(ascii), "%lld", value));
+}
+
+void housewiz_json_bool (struct WizJson *json, const char *key, int value) {
+    housewiz_json_key (json, key);
+    if (value) housewiz_json_raw (json, "true", 4);
+    else       housewiz_json_raw (json, "false", 5);
+}
+
+const char *housewiz_json_export (struct WizJson *json, const char **error) {
+    while ((json->depth > 0) && !json->error) housewiz_json_end (json);
+    if (!json->error) {
+        if (housewiz_json_room (json, 0)) json->buffer[json->length] = 0;
+    }
+    if (json->error) {
+        if (error) *error = json->error;
+        return 0;
+    }
+    return json->buffer;
+}
+
@@ -0,0 +1,48 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_json.h - A streaming JSON writer with a growing buffer.
+ *
+ */
+#define WIZ_JSON_DEPTH 16
+
+struct WizJson {
+    char *buffer;
+    int size;
+    int length;
+    int depth;
+    char type[WIZ_JSON_DEPTH];  // How to close each open item.
+    int count[WIZ_JSON_DEPTH];  // Items written in each open item.
+    const char *error;
+};
+
+void housewiz_json_start  (struct WizJson *json);
+void housewiz_json_object (struct WizJson *json, const char *key);
+void housewiz_json_array  (struct WizJson *json, const char *key);
+void housewiz_json_end    (struct WizJson *json);
+
+void housewiz_json_string  (struct WizJson *json,
+                            const char *key, const char *value);
+void housewiz_json_integer (struct WizJson *json,
+                            const char *key, long long value);
+void housewiz_json_bool    (struct WizJson *json, const char *key, int value);
+
+const char *housewiz_json_export (struct WizJson *json, const char **error);
+
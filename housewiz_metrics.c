@@ -0,0 +1,360 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_metrics.c - Counters and latency histograms.
+ *
+ * SYNOPSYS:
+ *
+ * This module provides the data structures and formatting used to report
+ * the device metrics. The latency histograms use logarithmic buckets:
+ * bucket N counts the latencies up to 2^N milliseconds, and the last
+ * bucket counts everything longer.
+ *
+ * long long housewiz_metrics_now (void);
+ *
+ *    Return a monotonic time in milliseconds, for measuring latencies.
+ *
+ * void housewiz_metrics_latency (struct WizLatency *latency, long long ms);
+ *
+ *    Record one latency measurement.
+ *
+ * void housewiz_metrics_json (struct WizJson *json,
+ *                             const struct WizCounters *counters);
+ *
+ *    Add the counters and latency histogram to the current JSON object.
+ *
+ * void housewiz_metrics_type (struct WizMetricsText *text,
+ *                             const char *family, const char *type);
+ * void housewiz_metrics_value (struct WizMetricsText *text,
+ *                              const char *family, const char *device,
+ *                              unsigned long value);
+ * void housewiz_metrics_histogram (struct WizMetricsText *text,
+ *                                  const char *family, const char *device,
+ *                                  const struct WizLatency *latency);
+ *
+ *    Format metrics in the Prometheus text format. The device label is
+ *    omitted if device is a null pointer. The text length is updated even
+ *    if the buffer is too small, so that the caller can retry with a
+ *    large enough buffer.
+ *
+ * void housewiz_metrics_initialize (int argc, const char **argv);
+ *
+ *    Initialize the profiling at startup. The options are:
+ *    -wiz-profile          Enable the profiling from the start.
+ *    -wiz-profile-budget=N The time budget of each probe, in microseconds.
+ *
+ * void housewiz_metrics_profile (int enabled);
+ * int  housewiz_metrics_profiling (void);
+ *
+ *    Enable or disable the profiling at runtime, or return its status.
+ *    Enabling the profiling clears the previous measurements.
+ *
+ * long long housewiz_metrics_start (void);
+ * void housewiz_metrics_stop (int probe, long long start);
+ *
+ *    Measure the duration of one execution of a probed section of code.
+ *    These cost almost nothing when the profiling is disabled.
+ *
+ * void housewiz_metrics_profile_json (struct WizJson *json);
+ * int  housewiz_metrics_profile_text (char *buffer, int size);
+ *
+ *    Report the profiling measurements, in JSON or in the Prometheus text
+ *    format. The latter returns the length of the text, which is more than
+ *    size if the buffer was too small.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "housewiz_json.h"
+#include "housewiz_metrics.h"
+
+
+// The profiling figures are in microseconds. The p99 figure is estimated
+// from a logarithmic histogram: this is the upper bound of the bucket.
+//
+struct WizProbe {
+    unsigned long count;
+    unsigned long overruns;
+    long long min;
+    long long max;
+    struct WizLatency histogram;
+};
+
+static const char *WizProbeNames[WIZ_PROBE_COUNT] = {
+    "receive", "periodic", "status", "set", "autosave", "background"
+};
+
+static struct WizProbe WizProbes[WIZ_PROBE_COUNT];
+static int WizProfiling = 0;
+static long long WizProfileBudget = 10000; // 10ms.
+
+
+long long housewiz_metrics_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void housewiz_metrics_latency (struct WizLatency *latency, long long ms) {
+
+    int bucket = 0;
+
+    if (ms < 0) ms = 0;
+    while ((bucket < WIZ_LATENCY_BUCKETS) && (ms > (1LL << bucket))) bucket++;
+
+    latency->buckets[bucket] += 1;
+    latency->count += 1;
+    latency->sum += ms;
+}
+
+void housewiz_metrics_json (struct WizJson *json,
+                            const struct WizCounters *counters) {
+    int i;
+
+    housewiz_json_integer (json, "sent", counters->sent);
+    housewiz_json_integer (json, "retries", counters->retries);
+    housewiz_json_integer (json, "timeouts", counters->timeouts);
+    housewiz_json_integer (json, "received", counters->received);
+    housewiz_json_integer (json, "reboots", counters->reboots);
+
+    housewiz_json_object (json, "latency");
+    housewiz_json_integer (json, "count", counters->latency.count);
+    housewiz_json_integer (json, "sum", counters->latency.sum);
+    housewiz_json_array (json, "buckets");
+    for (i = 0; i <= WIZ_LATENCY_BUCKETS; ++i)
+        housewiz_json_integer (json, 0, counters->latency.buckets[i]);
+    housewiz_json_end (json);
+    housewiz_json_end (json);
+}
+
+static void housewiz_metrics_print (struct WizMetricsText *text,
+                                    const char *format, ...) {
+    va_list args;
+    int room = text->size - text->length;
+    char *cursor = text->buffer + text->length;
+
+    if (room < 0) room = 0;
+    if (room == 0) cursor = 0;
+
+    va_start (args, format);
+    int length = vsnprintf (cursor, room, format, args);
+    va_end (args);
+    if (length > 0) text->length += length;
+}
+
+// The device name must be escaped in a label value.
+//
+static void housewiz_metrics_labels (struct WizMetricsText *text,
+                                     const char *device, const char *more) {
+
+    if (!device) {
+        if (more) housewiz_metrics_print (text, "{%s}", more);
+        return;
+    }
+    housewiz_metrics_print (text, "{device=\"");
+    for (; *device; ++device) {
+        switch (*device) {
+            case '\\': housewiz_metrics_print (text, "\\\\"); break;
+            case '"':  housewiz_metrics_print (text, "\\\""); break;
+            case '\n': housewiz_metrics_print (text, "\\n"); break;
+            default:   housewiz_metrics_print (text, "%c", *device);
+        }
+    }
+    if (more) housewiz_metrics_print (text, "\",%s}", more);
+    else      housewiz_metrics_print (text, "\"}");
+}
+
+void housewiz_metrics_type (struct WizMetricsText *text,
+                            const char *family, const char *type) {
+    housewiz_metrics_print (text, "# TYPE %s %s\n", family, type);
+}
+
+void housewiz_metrics_value (struct WizMetricsText *text,
+                             const char *family, const char *device,
+                             unsigned long value) {
+    housewiz_metrics_print (text, "%s", family);
+    housewiz_metrics_labels (text, device, 0);
+    housewiz_metrics_print (text, " %lu\n", value);
+}
+
+void housewiz_metrics_histogram (struct WizMetricsText *text,
+                                 const char *family, const char *device,
+                                 const struct WizLatency *latency) {
+    int i;
+    char le[32];
+    unsigned long cumulated = 0;
+
+    for (i = 0; i <= WIZ_LATENCY_BUCKETS; ++i) {
+        cumulated += latency->buckets[i];
+        if (i < WIZ_LATENCY_BUCKETS)
+            snprintf (le, sizeof(le), "le=\"%lld\"", 1LL << i);
+        else
+            snprintf (le, sizeof(le), "le=\"+Inf\"");
+        housewiz_metrics_print (text, "%s_bucket", family);
+        housewiz_metrics_labels (text, device, le);
+        housewiz_metrics_print (text, " %lu\n", cumulated);
+    }
+    housewiz_metrics_print (text, "%s_sum", family);
+    housewiz_metrics_labels (text, device, 0);
+    housewiz_metrics_print (text, " %llu\n", latency->sum);
+    housewiz_metrics_print (text, "%s_count", family);
+    housewiz_metrics_labels (text, device, 0);
+    housewiz_metrics_print (text, " %lu\n", latency->count);
+}
+
+void housewiz_metrics_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-wiz-profile", argv[i])) {
+            housewiz_metrics_profile (1);
+        } else if (echttp_option_match ("-wiz-profile-budget=", argv[i], &value)) {
+            WizProfileBudget = atoll(value);
+        }
+    }
+}
+
+void housewiz_metrics_profile (int enabled) {
+    if (enabled && !WizProfiling) memset (WizProbes, 0, sizeof(WizProbes));
+    WizProfiling = enabled;
+}
+
+int housewiz_metrics_profiling (void) {
+    return WizProfiling;
+}
+
+static long long housewiz_metrics_microseconds (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+long long housewiz_metrics_start (void) {
+    if (!WizProfiling) return 0;
+    return housewiz_metrics_microseconds ();
+}
+
+void housewiz_metrics_stop (int probe, long long start) {
+
+    if ((!WizProfiling) || (!start)) return;
+    if ((probe < 0) || (probe >= WIZ_PROBE_COUNT)) return;
+
+    long long duration = housewiz_metrics_microseconds () - start;
+    struct WizProbe *p = WizProbes + probe;
+
+    if ((!p->count) || (duration < p->min)) p->min = duration;
+    if (duration > p->max) p->max = duration;
+    if (duration > WizProfileBudget) p->overruns += 1;
+    p->count += 1;
+    housewiz_metrics_latency (&(p->histogram), duration);
+}
+
+static long long housewiz_metrics_p99 (const struct WizProbe *p) {
+
+    int i;
+    unsigned long cumulated = 0;
+    unsigned long threshold = p->count - p->count / 100;
+
+    for (i = 0; i < WIZ_LATENCY_BUCKETS; ++i) {
+        cumulated += p->histogram.buckets[i];
+        if (cumulated >= threshold) {
+            long long bound = 1LL << i;
+            return (bound < p->max) ? bound : p->max;
+        }
+    }
+    return p->max;
+}
+
+static long long housewiz_metrics_average (const struct WizProbe *p) {
+    if (!p->count) return 0;
+    return (long long)(p->histogram.sum / p->count);
+}
+
+void housewiz_metrics_profile_json (struct WizJson *json) {
+
+    int i;
+
+    housewiz_json_object (json, "profile");
+    housewiz_json_bool (json, "enabled", WizProfiling);
+    housewiz_json_integer (json, "budget", WizProfileBudget);
+
+    for (i = 0; WizProfiling && (i < WIZ_PROBE_COUNT); ++i) {
+        const struct WizProbe *p = WizProbes + i;
+        housewiz_json_object (json, WizProbeNames[i]);
+        housewiz_json_integer (json, "count", p->count);
+        housewiz_json_integer (json, "min", p->min);
+        housewiz_json_integer (json, "avg", housewiz_metrics_average(p));
+        housewiz_json_integer (json, "max", p->max);
+        housewiz_json_integer (json, "p99", housewiz_metrics_p99(p));
+        housewiz_json_integer (json, "overruns", p->overruns);
+        housewiz_json_end (json);
+    }
+    housewiz_json_end (json);
+}
+
+int housewiz_metrics_profile_text (char *buffer, int size) {
+
+    static const char *figures[] = {"min", "avg", "max", "p99", 0};
+    struct WizMetricsText text = {buffer, size, 0};
+    int f;
+    int i;
+
+    if (size > 0) buffer[0] = 0;
+    if (!WizProfiling) return 0;
+
+    housewiz_metrics_type (&text, "wiz_probe_calls_total", "counter");
+    for (i = 0; i < WIZ_PROBE_COUNT; ++i)
+        housewiz_metrics_print (&text, "wiz_probe_calls_total{probe=\"%s\"} %lu\n",
+                                WizProbeNames[i], WizProbes[i].count);
+
+    housewiz_metrics_type (&text, "wiz_probe_overruns_total", "counter");
+    for (i = 0; i < WIZ_PROBE_COUNT; ++i)
+        housewiz_metrics_print (&text, "wiz_probe_overruns_total{probe=\"%s\"} %lu\n",
+                                WizProbeNames[i], WizProbes[i].overruns);
+
+    for (f = 0; figures[f]; ++f) {
+        char family[64];
+        snprintf (family, sizeof(family), "wiz_probe_%s_us", figures[f]);
+        housewiz_metrics_type (&text, family, "gauge");
+        for (i = 0; i < WIZ_PROBE_COUNT; ++i) {
+            const struct WizProbe *p = WizProbes + i;
+            long long value;
+            switch (f) {
+                case 0: value = p->min; break;
+                case 1: value = housewiz_metrics_average(p); break;
+                case 2: value = p->max; break;
+                default: value = housewiz_metrics_p99(p);
+            }
+            housewiz_metrics_print (&text, "%s{probe=\"%s\"} %lld\n",
+                                    family, WizProbeNames[i], value);
+        }
+    }
+    return text.length;
+}
+
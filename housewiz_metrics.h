@@ -0,0 +1,83 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_metrics.h - Counters and latency histograms.
+ *
+ */
+#define WIZ_LATENCY_BUCKETS 16 // 1ms to 32s, plus one bucket for more.
+
+struct WizLatency {
+    unsigned long count;
+    unsigned long long sum; // Milliseconds.
+    unsigned long buckets[WIZ_LATENCY_BUCKETS+1];
+};
+
+struct WizCounters {
+    unsigned long sent;
+    unsigned long retries;
+    unsigned long timeouts;
+    unsigned long received;
+    unsigned long reboots;
+    struct WizLatency latency;
+};
+
+long long housewiz_metrics_now (void);
+
+void housewiz_metrics_latency (struct WizLatency *latency, long long ms);
+
+void housewiz_metrics_json (struct WizJson *json,
+                            const struct WizCounters *counters);
+
+struct WizMetricsText {
+    char *buffer;
+    int size;
+    int length; // Can be more than size if the buffer is too small.
+};
+
+void housewiz_metrics_type (struct WizMetricsText *text,
+                            const char *family, const char *type);
+
+void housewiz_metrics_value (struct WizMetricsText *text,
+                             const char *family, const char *device,
+                             unsigned long value);
+
+void housewiz_metrics_histogram (struct WizMetricsText *text,
+                                 const char *family, const char *device,
+                                 const struct WizLatency *latency);
+
+#define WIZ_PROBE_RECEIVE    0
+#define WIZ_PROBE_PERIODIC   1
+#define WIZ_PROBE_STATUS     2
+#define WIZ_PROBE_SET        3
+#define WIZ_PROBE_AUTOSAVE   4
+#define WIZ_PROBE_BACKGROUND 5
+#define WIZ_PROBE_COUNT      6
+
+void housewiz_metrics_initialize (int argc, const char **argv);
+
+void housewiz_metrics_profile (int enabled);
+int  housewiz_metrics_profiling (void);
+
+long long housewiz_metrics_start (void);
+void housewiz_metrics_stop (int probe, long long start);
+
+void housewiz_metrics_profile_json (struct WizJson *json);
+int  housewiz_metrics_profile_text (char *buffer, int size);
+
@@ -0,0 +1,579 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housewiz_pipeline.c - Receive and decode the device messages in threads.
+ *
+ * SYNOPSYS:
+ *
+ * This module is an optional multi-threaded receive path. Each worker
+ * thread reads from its own UDP socket and decodes the messages. All the
+ * worker sockets are bound to the status port with SO_REUSEPORT, so that
+ * the kernel spreads the devices over the workers.
+ *
+ * Each worker posts the decoded messages, in a compact form, to its own
+ * single-producer, single-consumer ring. The main loop is woken up through
+ * an eventfd, and applies the updates. The workers never access the device
+ * tables, and the main loop never waits for the workers. If a ring is
+ * full, the update is lost: the periodic queries will recover.
+ *
+ * The devices answer a query to the address and port it was sent from,
+ * not to the status port. The sockets used to send the queries can be
+ * attached to the pipeline, so that these answers (including a whole
+ * fleet answering a broadcast) are received by the workers too. An
+ * attached socket is read by one worker at a time.
+ *
+ * int housewiz_pipeline_start (int workers, int port, int rcvbuf,
+ *                              int budget, housewiz_pipeline_apply *apply);
+ *
+ *    Start the workers. The apply callback is called from the main loop,
+ *    for at most budget updates per wakeup. Return the number of workers
+ *    started, 0 if none could be started.
+ *
+ * int  housewiz_pipeline_attach (int fd);
+ * void housewiz_pipeline_detach (int fd);
+ *
+ *    Have the workers receive from a (non blocking) socket also used by
+ *    the main loop to send, or stop doing so. Attach returns 1 on success,
+ *    0 if the socket must be read by the main loop. A socket must be
+ *    detached before it is closed.
+ *
+ * void housewiz_pipeline_message (const struct WizUpdate *update,
+ *                                 struct WizMessage *message);
+ *
+ *    Convert an update back into a decoded message. The strings point
+ *    within the update.
+ *
+ * unsigned long housewiz_pipeline_dropped (void);
+ *
+ *    Return the number of packets lost: dropped by the kernel, truncated,
+ *    or lost because a ring was full.
+ */
+
+#define _GNU_SOURCE // For recvmmsg().
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housewiz_decode.h"
+#include "housewiz_hash.h"
+#include "housewiz_json.h"
+#include "housewiz_metrics.h"
+#include "housewiz_pipeline.h"
+
+#define WIZ_PIPELINE_RING   4096 // Updates per worker, a power of 2.
+#define WIZ_PIPELINE_BATCH  64
+#define WIZ_PIPELINE_PACKET 512
+#define WIZ_PIPELINE_MAX    16   // Workers.
+#define WIZ_PIPELINE_SENDERS 64  // Attached sockets.
+#define WIZ_PIPELINE_EVENTS 16
+
+#define WIZ_PIPELINE_OWN    (~(uint64_t)0) // The epoll tag of a worker socket.
+
+struct PipelineWorker {
+    pthread_t thread;
+    int socket;
+    int epoll;
+    struct WizUpdate *ring;
+    atomic_uint head; // Written by the worker only.
+    atomic_uint tail; // Written by the main loop only.
+    atomic_ulong overflows;
+    atomic_ulong truncated;
+    atomic_uint dropped; // Reported by the kernel.
+};
+
+static struct PipelineWorker PipelineWorkers[WIZ_PIPELINE_MAX];
+
+// The sockets attached by the main loop. Each worker's epoll tags these
+// with the slot and generation, so that a late event for a socket that
+// was detached is ignored, even if the slot was reused since.
+//
+struct PipelineSender {
+    int fd; // -1 if the slot is free.
+    unsigned int generation;
+    atomic_uint dropped;
+};
+
+static struct PipelineSender PipelineSenders[WIZ_PIPELINE_SENDERS];
+static pthread_mutex_t PipelineSendersLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long PipelineSendersDropped = 0; // Of detached sockets.
+static int PipelineCount = 0;
+static int PipelineSignal = -1;
+static int PipelineBudget = 256;
+static housewiz_pipeline_apply *PipelineApply = 0;
+
+
+static void safecpy (char *dest, const char *src, int length, int limit) {
+    if (length >= limit) length = limit - 1;
+    memcpy (dest, src, length);
+    dest[length] = 0;
+}
+
+static void housewiz_pipeline_decode (const char *data, int length,
+                                      const struct sockaddr_in *addr,
+                                      struct WizUpdate *update) {
+
+    struct WizMessage message;
+
+    update->addr = *addr;
+
+    // The main loop uses the fingerprint to recognize a heartbeat that
+    // is identical to the previous one, and then skips the update.
+    update->fingerprint = housewiz_hash64 (data, length);
+    if (!update->fingerprint) update->fingerprint = 1;
+
+    safecpy (update->excerpt, data, length, sizeof(update->excerpt));
+
+    const char *error = housewiz_decode (data, length, &message);
+    if (error) {
+        safecpy (update->error, error, strlen(error), sizeof(update->error));
+        return;
+    }
+    update->error[0] = 0;
+    update->method = message.method;
+    update->state = message.state;
+    update->dimming = message.dimming;
+    update->temp = message.temp;
+    update->scene = message.scene;
+    update->red = message.red;
+    update->green = message.green;
+    update->blue = message.blue;
+    update->rssi = message.rssi;
+
+    // An oversized MAC address keeps its length, so that it is rejected.
+    update->maclength = message.maclength;
+    if (message.mac)
+        safecpy (update->mac, message.mac, message.maclength, sizeof(update->mac));
+    else
+        update->mac[0] = 0;
+
+    update->firmwarelength = 0;
+    if (message.firmware) {
+        safecpy (update->firmware, message.firmware,
+                 message.firmwarelength, sizeof(update->firmware));
+        update->firmwarelength = strlen(update->firmware);
+    }
+}
+
+// The buffers of one recvmmsg() call, in the worker's stack.
+//
+struct PipelineBatch {
+    char data[WIZ_PIPELINE_BATCH][WIZ_PIPELINE_PACKET];
+    struct sockaddr_in addr[WIZ_PIPELINE_BATCH];
+    struct iovec iov[WIZ_PIPELINE_BATCH];
+    union {
+        char buffer[CMSG_SPACE(sizeof(uint32_t))];
+        struct cmsghdr align;
+    } control[WIZ_PIPELINE_BATCH];
+    struct mmsghdr msg[WIZ_PIPELINE_BATCH];
+};
+
+static int housewiz_pipeline_receive (int fd, struct PipelineBatch *batch) {
+
+    int i;
+
+    for (i = 0; i < WIZ_PIPELINE_BATCH; ++i) {
+        batch->iov[i].iov_base = batch->data[i];
+        batch->iov[i].iov_len = WIZ_PIPELINE_PACKET - 1; // Room for a terminator.
+        batch->msg[i].msg_hdr.msg_name = batch->addr + i;
+        batch->msg[i].msg_hdr.msg_namelen = sizeof(batch->addr[0]);
+        batch->msg[i].msg_hdr.msg_iov = batch->iov + i;
+        batch->msg[i].msg_hdr.msg_iovlen = 1;
+        batch->msg[i].msg_hdr.msg_control = batch->control[i].buffer;
+        batch->msg[i].msg_hdr.msg_controllen = sizeof(batch->control[0].buffer);
+        batch->msg[i].msg_hdr.msg_flags = 0;
+        batch->msg[i].msg_len = 0;
+    }
+    int count = recvmmsg (fd, batch->msg, WIZ_PIPELINE_BATCH, MSG_DONTWAIT, 0);
+    if ((count < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+        (errno != EINTR)) usleep (10000); // Do not spin on a socket error.
+    return count;
+}
+
+// Decode the received messages and post them to the worker's ring.
+// The drop count reported by the kernel is per socket.
+//
+static void housewiz_pipeline_post (struct PipelineWorker *worker,
+                                    struct PipelineBatch *batch, int count,
+                                    atomic_uint *dropped) {
+
+    unsigned int head = atomic_load_explicit (&worker->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit (&worker->tail, memory_order_acquire);
+    int posted = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        struct msghdr *hdr = &(batch->msg[i].msg_hdr);
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t value;
+                memcpy (&value, CMSG_DATA(cmsg), sizeof(value));
+                atomic_store_explicit (dropped, value, memory_order_relaxed);
+            }
+        }
+        if (hdr->msg_flags & MSG_TRUNC) {
+            atomic_fetch_add_explicit (&worker->truncated, 1,
+                                       memory_order_relaxed);
+            continue;
+        }
+        int size = batch->msg[i].msg_len;
+        if (size <= 0) continue;
+        batch->data[i][size] = 0;
+
+        if (head - tail >= WIZ_PIPELINE_RING) {
+            tail = atomic_load_explicit (&worker->tail, memory_order_acquire);
+            if (head - tail >= WIZ_PIPELINE_RING) {
+                atomic_fetch_add_explicit (&worker->overflows, 1,
+                                           memory_order_relaxed);
+                continue;
+            }
+        }
+        housewiz_pipeline_decode (batch->data[i], size, batch->addr + i,
+                                  worker->ring + (head & (WIZ_PIPELINE_RING - 1)));
+        head += 1;
+        posted += 1;
+    }
+    if (posted) {
+        uint64_t one = 1;
+        atomic_store_explicit (&worker->head, head, memory_order_release);
+        if (write (PipelineSignal, &one, sizeof(one)) < 0) return;
+    }
+}
+
+// Receive from one of the sockets shared with the main loop, if it is
+// still attached: the lock guarantees that the main loop does not close
+// the socket while a worker reads it.
+//
+static void housewiz_pipeline_sender (struct PipelineWorker *worker,
+                                      struct PipelineBatch *batch,
+                                      uint64_t tag) {
+
+    unsigned int slot = (unsigned int)(tag & 0xffffffff);
+    unsigned int generation = (unsigned int)(tag >> 32);
+    atomic_uint *dropped = 0;
+    int count = 0;
+
+    if (slot >= WIZ_PIPELINE_SENDERS) return;
+    struct PipelineSender *sender = PipelineSenders + slot;
+
+    pthread_mutex_lock (&PipelineSendersLock);
+    if ((sender->fd >= 0) && (sender->generation == generation)) {
+        count = housewiz_pipeline_receive (sender->fd, batch);
+        dropped = &(sender->dropped);
+    }
+    pthread_mutex_unlock (&PipelineSendersLock);
+
+    // The drop count may be lost if the socket was just detached:
+    // that count is only informational.
+    if (count > 0) housewiz_pipeline_post (worker, batch, count, dropped);
+}
+
+static void *housewiz_pipeline_worker (void *context) {
+
+    struct PipelineWorker *worker = (struct PipelineWorker *)context;
+    struct PipelineBatch batch;
+    struct epoll_event events[WIZ_PIPELINE_EVENTS];
+    int i;
+
+    for (;;) {
+        int ready = epoll_wait (worker->epoll, events, WIZ_PIPELINE_EVENTS, -1);
+        if (ready <= 0) {
+            if ((ready < 0) && (errno != EINTR)) usleep (10000);
+            continue;
+        }
+        for (i = 0; i < ready; ++i) {
+            if (events[i].data.u64 == WIZ_PIPELINE_OWN) {
+                int count = housewiz_pipeline_receive (worker->socket, &batch);
+                if (count > 0)
+                    housewiz_pipeline_post (worker, &batch, count,
+                                            &(worker->dropped));
+            } else {
+                housewiz_pipeline_sender (worker, &batch, events[i].data.u64);
+            }
+        }
+    }
+    return 0;
+}
+
+static void housewiz_pipeline_wakeup (int fd, int mode) {
+
+    static int first = 0; // Rotate, so that no worker is favored.
+    uint64_t signals;
+    int budget = PipelineBudget;
+    int i;
+
+    if (read (fd, &signals, sizeof(signals)) < 0) return;
+
+    long long start = housewiz_metrics_start ();
+    long long now = housewiz_metrics_now();
+
+    for (i = 0; i < PipelineCount; ++i) {
+        struct PipelineWorker *worker =
+            PipelineWorkers + ((first + i) % PipelineCount);
+        unsigned int tail = atomic_load_explicit (&worker->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit (&worker->head, memory_order_acquire);
+        while ((tail != head) && (budget > 0)) {
+            PipelineApply (worker->ring + (tail & (WIZ_PIPELINE_RING - 1)), now);
+            tail += 1;
+            budget -= 1;
+        }
+        atomic_store_explicit (&worker->tail, tail, memory_order_release);
+    }
+    first = (first + 1) % PipelineCount;
+
+    if (budget <= 0) {
+        // Leave some room for the other I/Os, and come back for the rest.
+        uint64_t one = 1;
+        if (write (fd, &one, sizeof(one)) < 0)
+            houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                            "cannot signal: %s", strerror(errno));
+    }
+    housewiz_metrics_stop (WIZ_PROBE_RECEIVE, start);
+}
+
+static int housewiz_pipeline_socket (int port, int rcvbuf) {
+
+    struct sockaddr_in local;
+    int value = 1;
+
+    int s = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0) {
+        houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                        "cannot open UDP socket: %s", strerror(errno));
+        return -1;
+    }
+    if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                        "cannot share port %d: %s", port, strerror(errno));
+        close (s);
+        return -1;
+    }
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind (s, (struct sockaddr *)(&local), sizeof(local)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                        "cannot bind to UDP port %d: %s", port, strerror(errno));
+        close (s);
+        return -1;
+    }
+
+    // The following options are not critical: report, but continue.
+    //
+    value = 1;
+    if (setsockopt (s, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) < 0)
+        houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                        "cannot count drops: %s", strerror(errno));
+    if (rcvbuf > 0) {
+        if (setsockopt (s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+            houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                            "cannot set receive buffer to %d: %s",
+                            rcvbuf, strerror(errno));
+    }
+    return s;
+}
+
+int housewiz_pipeline_start (int workers, int port, int rcvbuf,
+                             int budget, housewiz_pipeline_apply *apply) {
+    int i;
+
+    if (workers > WIZ_PIPELINE_MAX) workers = WIZ_PIPELINE_MAX;
+    if (budget > 0) PipelineBudget = budget;
+    for (i = 0; i < WIZ_PIPELINE_SENDERS; ++i) {
+        PipelineSenders[i].fd = -1;
+        atomic_init (&(PipelineSenders[i].dropped), 0);
+    }
+    PipelineApply = apply;
+
+    PipelineSignal = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (PipelineSignal < 0) {
+        houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                        "cannot create eventfd: %s", strerror(errno));
+        return 0;
+    }
+
+    for (i = 0; i < workers; ++i) {
+        struct PipelineWorker *worker = PipelineWorkers + PipelineCount;
+        worker->ring = calloc (WIZ_PIPELINE_RING, sizeof(struct WizUpdate));
+        if (!worker->ring) break;
+        worker->socket = housewiz_pipeline_socket (port, rcvbuf);
+        if (worker->socket < 0) {
+            free (worker->ring);
+            break;
+        }
+        atomic_init (&worker->head, 0);
+        atomic_init (&worker->tail, 0);
+        atomic_init (&worker->overflows, 0);
+        atomic_init (&worker->truncated, 0);
+        atomic_init (&worker->dropped, 0);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = WIZ_PIPELINE_OWN;
+        worker->epoll = epoll_create1 (EPOLL_CLOEXEC);
+        if ((worker->epoll < 0) ||
+            (epoll_ctl (worker->epoll, EPOLL_CTL_ADD,
+                        worker->socket, &event) < 0)) {
+            houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                            "cannot create epoll: %s", strerror(errno));
+            if (worker->epoll >= 0) close (worker->epoll);
+            close (worker->socket);
+            free (worker->ring);
+            break;
+        }
+        if (pthread_create (&(worker->thread), 0,
+                            housewiz_pipeline_worker, worker)) {
+            houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                            "cannot start worker: %s", strerror(errno));
+            close (worker->epoll);
+            close (worker->socket);
+            free (worker->ring);
+            break;
+        }
+        pthread_detach (worker->thread);
+        PipelineCount += 1;
+    }
+    if (PipelineCount <= 0) {
+        close (PipelineSignal);
+        PipelineSignal = -1;
+        return 0;
+    }
+    echttp_listen (PipelineSignal, 1, housewiz_pipeline_wakeup, 0);
+    houselog_trace (HOUSE_INFO, "PIPELINE",
+                    "%d receive workers on UDP port %d", PipelineCount, port);
+    return PipelineCount;
+}
+
+void housewiz_pipeline_detach (int fd) {
+
+    int slot;
+    int i;
+
+    pthread_mutex_lock (&PipelineSendersLock);
+    for (slot = 0; slot < WIZ_PIPELINE_SENDERS; ++slot) {
+        if (PipelineSenders[slot].fd == fd) break;
+    }
+    if (slot < WIZ_PIPELINE_SENDERS) {
+        PipelineSenders[slot].fd = -1;
+        PipelineSendersDropped +=
+            atomic_exchange (&(PipelineSenders[slot].dropped), 0);
+    }
+    pthread_mutex_unlock (&PipelineSendersLock);
+    if (slot >= WIZ_PIPELINE_SENDERS) return;
+
+    for (i = 0; i < PipelineCount; ++i)
+        epoll_ctl (PipelineWorkers[i].epoll, EPOLL_CTL_DEL, fd, 0);
+}
+
+int housewiz_pipeline_attach (int fd) {
+
+    struct epoll_event event;
+    int slot;
+    int i;
+
+    if (PipelineCount <= 0) return 0;
+
+    pthread_mutex_lock (&PipelineSendersLock);
+    for (slot = 0; slot < WIZ_PIPELINE_SENDERS; ++slot) {
+        if (PipelineSenders[slot].fd < 0) break;
+    }
+    if (slot < WIZ_PIPELINE_SENDERS) {
+        PipelineSenders[slot].fd = fd;
+        PipelineSenders[slot].generation += 1;
+        event.data.u64 = ((uint64_t)PipelineSenders[slot].generation << 32) | slot;
+    }
+    pthread_mutex_unlock (&PipelineSendersLock);
+    if (slot >= WIZ_PIPELINE_SENDERS) {
+        houselog_trace (HOUSE_FAILURE, "PIPELINE", "too many sockets");
+        return 0;
+    }
+
+    // Wake up only one worker for each answer, if the kernel supports it.
+    //
+    for (i = 0; i < PipelineCount; ++i) {
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        if (epoll_ctl (PipelineWorkers[i].epoll, EPOLL_CTL_ADD, fd, &event) == 0)
+            continue;
+        event.events = EPOLLIN;
+        if ((errno == EINVAL) &&
+            (epoll_ctl (PipelineWorkers[i].epoll, EPOLL_CTL_ADD, fd, &event) == 0))
+            continue;
+        houselog_trace (HOUSE_FAILURE, "PIPELINE",
+                        "cannot attach socket: %s", strerror(errno));
+        housewiz_pipeline_detach (fd);
+        return 0;
+    }
+    return 1;
+}
+
+void housewiz_pipeline_message (const struct WizUpdate *update,
+                                struct WizMessage *message) {
+    message->method = update->method;
+    message->mac = update->mac;
+    message->maclength = update->maclength;
+    message->state = update->state;
+    message->dimming = update->dimming;
+    message->temp = update->temp;
+    message->scene = update->scene;
+    message->red = update->red;
+    message->green = update->green;
+    message->blue = update->blue;
+    message->rssi = update->rssi;
+    message->firmware = update->firmwarelength ? update->firmware : 0;
+    message->firmwarelength = update->firmwarelength;
+}
+
+unsigned long housewiz_pipeline_dropped (void) {
+    int i;
+    unsigned long total = 0;
+    for (i = 0; i < PipelineCount; ++i) {
+        struct PipelineWorker *worker = PipelineWorkers + i;
+        total += atomic_load_explicit (&worker->dropped, memory_order_relaxed);
+        total += atomic_load_explicit (&worker->truncated, memory_order_relaxed);
+        total += atomic_load_explicit (&worker->overflows, memory_order_relaxed);
+    }
+    pthread_mutex_lock (&PipelineSendersLock);
+    total += PipelineSendersDropped;
+    for (i = 0; i < WIZ_PIPELINE_SENDERS; ++i) {
+        if (PipelineSenders[i].fd < 0) continue;
+        total += atomic_load_explicit (&(PipelineSenders[i].dropped),
+                                       memory_order_relaxed);
+    }
+    pthread_mutex_unlock (&PipelineSendersLock);
+    return total;
+}
@@ -0,0 +1,57 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housewiz_pipeline.h - Receive and decode the device messages in threads.
+ *
+ */
+struct WizUpdate {
+    struct sockaddr_in addr;
+    uint64_t fingerprint; // Of the whole message, never 0.
+    char error[64];    // Empty if the message was decoded.
+    char excerpt[128]; // The start of the message, for the traces.
+    int method;
+    int state;
+    int dimming;
+    int temp;
+    int scene;
+    int red;
+    int green;
+    int blue;
+    int rssi;
+    char mac[16];
+    int maclength;
+    char firmware[32];
+    int firmwarelength;
+};
+
+typedef void housewiz_pipeline_apply (const struct WizUpdate *update,
+                                      long long now);
+
+int housewiz_pipeline_start (int workers, int port, int rcvbuf,
+                             int budget, housewiz_pipeline_apply *apply);
+
+int  housewiz_pipeline_attach (int fd);
+void housewiz_pipeline_detach (int fd);
+
+void housewiz_pipeline_message (const struct WizUpdate *update,
+                                struct WizMessage *message);
+
+unsigned long housewiz_pipeline_dropped (void);
@@ -0,0 +1,475 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_queue.c - Pace and coalesce the outgoing UDP packets.
+ *
+ * SYNOPSYS:
+ *
+ * This module sits between the Wiz protocol and the network. Sending a
+ * large number of packets at once tends to overwhelm cheap WiFi access
+ * points, which then drop many of these packets. This module queues the
+ * outgoing packets and sends them in batches at a controlled rate.
+ *
+ * void housewiz_queue_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module at startup. The options are:
+ *    -wiz-send-rate=N    The maximum number of packets sent per second.
+ *    -wiz-send-burst=N   The maximum number of packets sent at once.
+ *    -wiz-send-gap=N     The minimum interval between two packets sent
+ *                        to the same destination, in milliseconds.
+ *
+ * void housewiz_queue_submit (int socket, unsigned long key,
+ *                             const struct sockaddr_in *destination,
+ *                             const char *data, int length);
+ *
+ *    Queue one packet for sending. If another packet with the same non-zero
+ *    key is still queued, that packet is replaced with the new one (the
+ *    last submitted wins), but keeps its place in the queue. A key of 0
+ *    means that the packet is never merged.
+ *
+ * void housewiz_queue_submitv (int socket, unsigned long key,
+ *                              const struct sockaddr_in *destination,
+ *                              const struct iovec *parts, int count);
+ *
+ *    Same as housewiz_queue_submit(), for a packet made of several parts,
+ *    typically a constant template and a few variable bytes. The parts are
+ *    gathered when the packet is queued, or sent as is if pacing is not
+ *    possible.
+ *
+ * void housewiz_queue_forget (void);
+ *
+ *    Forget the keys of all the queued packets, which are still sent but
+ *    can no longer be replaced. This is used when the meaning of the keys
+ *    changes, e.g. when the devices are renumbered.
+ *
+ * int housewiz_queue_pending (void);
+ *
+ *    Return the number of packets waiting to be sent.
+ *
+ * A full socket send buffer is normal under load: the packets that could
+ * not be sent stay at the head of the queue, and are sent on the next
+ * tick.
+ */
+
+#define _GNU_SOURCE // For sendmmsg().
+
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "housewiz_queue.h"
+
+#define WIZ_QUEUE_PACKET 256 // Largest packet accepted.
+#define WIZ_QUEUE_BATCH  64  // Largest sendmmsg() batch.
+#define WIZ_QUEUE_TICK   10  // Milliseconds between two flushes.
+
+struct QueueEntry {
+    unsigned long key;
+    int socket;
+    int length;
+    struct sockaddr_in destination;
+    char data[WIZ_QUEUE_PACKET];
+};
+
+static struct QueueEntry *QueuePool = 0;
+static int *QueueFifo = 0; // Circular list of entries, in send order.
+static int *QueueFree = 0; // Stack of unused entries.
+static int QueueSpace = 0;
+static int QueueHead = 0;
+static int QueueCount = 0;
+static int QueueFreeCount = 0;
+
+// The key index is an open addressing hash table that maps a key to
+// its queued entry, used to merge packets.
+//
+#define QUEUE_KEY_EMPTY   (-1)
+#define QUEUE_KEY_DELETED (-2)
+
+struct QueueKey {
+    unsigned long key;
+    int entry;
+};
+
+static struct QueueKey *QueueKeys = 0;
+static int QueueKeysSize = 0; // Always a power of 2.
+static int QueueKeysDeleted = 0;
+
+// Remember when the last packet was sent to each destination. This is
+// a direct mapped cache: collisions only make the pacing less accurate.
+//
+#define QUEUE_RECENT 1024
+
+static struct {
+    in_addr_t ip;
+    long long sent;
+} QueueRecent[QUEUE_RECENT];
+
+static int QueueRate = 100;
+static int QueueBurst = 16;
+static int QueueGap = 20;
+
+static double QueueTokens = 0.0;
+static long long QueueRefilled = 0;
+
+static int QueueTimer = -1;
+static int QueueTimerArmed = 0;
+
+
+static long long housewiz_queue_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int housewiz_queue_hash (unsigned long key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (unsigned int)key;
+}
+
+static int housewiz_queue_key_search (unsigned long key) {
+    unsigned int mask = QueueKeysSize - 1;
+    unsigned int slot = housewiz_queue_hash (key) & mask;
+    while (QueueKeys[slot].entry != QUEUE_KEY_EMPTY) {
+        if ((QueueKeys[slot].entry >= 0) && (QueueKeys[slot].key == key))
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static void housewiz_queue_key_insert (unsigned long key, int entry) {
+    unsigned int mask = QueueKeysSize - 1;
+    unsigned int slot = housewiz_queue_hash (key) & mask;
+    while (QueueKeys[slot].entry >= 0) slot = (slot + 1) & mask;
+    if (QueueKeys[slot].entry == QUEUE_KEY_DELETED) QueueKeysDeleted -= 1;
+    QueueKeys[slot].key = key;
+    QueueKeys[slot].entry = entry;
+}
+
+static void housewiz_queue_key_rebuild (void) {
+    int i;
+    for (i = 0; i < QueueKeysSize; ++i) QueueKeys[i].entry = QUEUE_KEY_EMPTY;
+    QueueKeysDeleted = 0;
+    for (i = 0; i < QueueCount; ++i) {
+        int entry = QueueFifo[(QueueHead + i) % QueueSpace];
+        if (QueuePool[entry].key)
+            housewiz_queue_key_insert (QueuePool[entry].key, entry);
+    }
+}
+
+static void housewiz_queue_key_remove (unsigned long key) {
+    if (!key) return;
+    int slot = housewiz_queue_key_search (key);
+    if (slot < 0) return;
+    QueueKeys[slot].entry = QUEUE_KEY_DELETED;
+    if (++QueueKeysDeleted > QueueKeysSize / 4) housewiz_queue_key_rebuild ();
+}
+
+static int housewiz_queue_grow (void) {
+
+    int i;
+    int space = QueueSpace ? QueueSpace * 2 : 64;
+
+    struct QueueEntry *pool = realloc (QueuePool, space * sizeof(*pool));
+    if (!pool) return 0;
+    QueuePool = pool;
+
+    int *fifo = malloc (space * sizeof(int));
+    int *freelist = realloc (QueueFree, space * sizeof(int));
+    struct QueueKey *keys = malloc (2 * space * sizeof(*keys));
+    if (freelist) QueueFree = freelist;
+    if ((!fifo) || (!freelist) || (!keys)) {
+        free (fifo);
+        free (keys);
+        return 0;
+    }
+
+    // Linearize the circular list, so that the head is now at index 0.
+    for (i = 0; i < QueueCount; ++i)
+        fifo[i] = QueueFifo[(QueueHead + i) % QueueSpace];
+    free (QueueFifo);
+    QueueFifo = fifo;
+    QueueHead = 0;
+
+    for (i = space - 1; i >= QueueSpace; --i) QueueFree[QueueFreeCount++] = i;
+    QueueSpace = space;
+
+    free (QueueKeys);
+    QueueKeys = keys;
+    QueueKeysSize = 2 * space;
+    housewiz_queue_key_rebuild ();
+    return 1;
+}
+
+static void housewiz_queue_arm (int active) {
+
+    struct itimerspec timer;
+
+    if (QueueTimer < 0) return;
+    if (active == QueueTimerArmed) return;
+
+    memset (&timer, 0, sizeof(timer));
+    if (active) {
+        timer.it_value.tv_nsec = 1000000; // Flush very soon.
+        timer.it_interval.tv_nsec = WIZ_QUEUE_TICK * 1000000;
+    }
+    if (timerfd_settime (QueueTimer, 0, &timer, 0) < 0) {
+        houselog_trace (HOUSE_FAILURE, "QUEUE",
+                        "timerfd_settime() error: %s", strerror(errno));
+        return;
+    }
+    QueueTimerArmed = active;
+}
+
+// Return how many packets were handled: sent, or dropped because of an
+// error. The packets that remain could not be sent yet.
+//
+static int housewiz_queue_transmit (int socket,
+                                    struct mmsghdr *msg, int count) {
+    int total = 0;
+    while (total < count) {
+        int sent = sendmmsg (socket, msg + total, count - total, 0);
+        if (sent <= 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                (errno == ENOBUFS)) break; // Wait for the next tick.
+            houselog_trace (HOUSE_FAILURE, "QUEUE",
+                            "sendmmsg() error: %s", strerror(errno));
+            sent = 1; // Drop this packet, the retries will take over.
+        }
+        total += sent;
+    }
+    return total;
+}
+
+// Send one batch. The packets not sent go back to the head of the queue,
+// in their original order. Return the number of packets handled.
+//
+static int housewiz_queue_batch (struct mmsghdr *msg,
+                                 const int *entries, int count) {
+    int done = housewiz_queue_transmit (QueuePool[entries[0]].socket, msg, count);
+    int i;
+    for (i = 0; i < done; ++i) QueueFree[QueueFreeCount++] = entries[i];
+    for (i = count - 1; i >= done; --i) {
+        int entry = entries[i];
+        QueueHead = (QueueHead + QueueSpace - 1) % QueueSpace;
+        QueueFifo[QueueHead] = entry;
+        QueueCount += 1;
+        if (QueuePool[entry].key)
+            housewiz_queue_key_insert (QueuePool[entry].key, entry);
+    }
+    return done;
+}
+
+static void housewiz_queue_flush (void) {
+
+    static struct mmsghdr msg[WIZ_QUEUE_BATCH];
+    static struct iovec iov[WIZ_QUEUE_BATCH];
+    static int sent[WIZ_QUEUE_BATCH];
+
+    long long now = housewiz_queue_now();
+    int budget = WIZ_QUEUE_BATCH;
+    int batched = 0;
+    int total = 0;
+    int done;
+
+    if (QueueRate > 0) {
+        QueueTokens += ((now - QueueRefilled) * QueueRate) / 1000.0;
+        if (QueueTokens > QueueBurst) QueueTokens = QueueBurst;
+        if (budget > (int)QueueTokens) budget = (int)QueueTokens;
+    }
+    QueueRefilled = now;
+
+    // Do not go around the queue more than once. Entries that must wait
+    // because of their destination are moved to the end of the queue.
+    //
+    int scan = QueueCount;
+
+    while ((scan-- > 0) && (total + batched < budget)) {
+
+        int entry = QueueFifo[QueueHead];
+        struct QueueEntry *e = QueuePool + entry;
+        in_addr_t ip = e->destination.sin_addr.s_addr;
+        int recent = (ntohl(ip) * 2654435761u) % QUEUE_RECENT;
+
+        if ((QueueGap > 0) && (QueueRecent[recent].ip == ip) &&
+            (now < QueueRecent[recent].sent + QueueGap)) {
+            QueueHead = (QueueHead + 1) % QueueSpace;
+            QueueFifo[(QueueHead + QueueCount - 1) % QueueSpace] = entry;
+            continue;
+        }
+
+        // The batch must be sent before switching to another socket. If
+        // that socket is full, stop here: this entry stays in the queue.
+        //
+        if ((batched > 0) && (QueuePool[sent[0]].socket != e->socket)) {
+            done = housewiz_queue_batch (msg, sent, batched);
+            total += done;
+            if (done < batched) {
+                batched = 0;
+                break;
+            }
+            batched = 0;
+        }
+        QueueHead = (QueueHead + 1) % QueueSpace;
+        QueueCount -= 1;
+        QueueRecent[recent].ip = ip;
+        QueueRecent[recent].sent = now;
+        housewiz_queue_key_remove (e->key);
+
+        iov[batched].iov_base = e->data;
+        iov[batched].iov_len = e->length;
+        memset (&(msg[batched]), 0, sizeof(msg[0]));
+        msg[batched].msg_hdr.msg_name = &(e->destination);
+        msg[batched].msg_hdr.msg_namelen = sizeof(e->destination);
+        msg[batched].msg_hdr.msg_iov = iov + batched;
+        msg[batched].msg_hdr.msg_iovlen = 1;
+        sent[batched++] = entry;
+    }
+    if (batched > 0) total += housewiz_queue_batch (msg, sent, batched);
+    if (QueueRate > 0) QueueTokens -= total;
+
+    housewiz_queue_arm (QueueCount > 0);
+}
+
+static void housewiz_queue_tick (int fd, int mode) {
+    uint64_t expirations;
+    if (read (fd, &expirations, sizeof(expirations)) < 0) return;
+    housewiz_queue_flush ();
+}
+
+void housewiz_queue_submitv (int socket, unsigned long key,
+                             const struct sockaddr_in *destination,
+                             const struct iovec *parts, int count) {
+
+    int length = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) length += parts[i].iov_len;
+    if (length > WIZ_QUEUE_PACKET) {
+        houselog_trace (HOUSE_FAILURE, "QUEUE",
+                        "packet too large (%d bytes)", length);
+        return;
+    }
+
+    if (QueueTimer < 0) {
+        // No timer, no pacing possible: send immediately.
+        struct msghdr msg;
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_name = (void *)destination;
+        msg.msg_namelen = sizeof(*destination);
+        msg.msg_iov = (struct iovec *)parts;
+        msg.msg_iovlen = count;
+        if (sendmsg (socket, &msg, 0) < 0)
+            houselog_trace (HOUSE_FAILURE, "QUEUE",
+                            "sendmsg() error: %s", strerror(errno));
+        return;
+    }
+
+    int entry = -1;
+    if (key && QueueKeys) {
+        int slot = housewiz_queue_key_search (key);
+        if (slot >= 0) entry = QueueKeys[slot].entry;
+    }
+    if (entry < 0) {
+        if ((QueueFreeCount <= 0) && (!housewiz_queue_grow ())) {
+            houselog_trace (HOUSE_FAILURE, "QUEUE", "no more memory");
+            return;
+        }
+        entry = QueueFree[--QueueFreeCount];
+        QueueFifo[(QueueHead + QueueCount) % QueueSpace] = entry;
+        QueueCount += 1;
+        if (key) housewiz_queue_key_insert (key, entry);
+    }
+
+    struct QueueEntry *e = QueuePool + entry;
+    e->key = key;
+    e->socket = socket;
+    e->destination = *destination;
+    char *cursor = e->data;
+    for (i = 0; i < count; ++i) {
+        memcpy (cursor, parts[i].iov_base, parts[i].iov_len);
+        cursor += parts[i].iov_len;
+    }
+    e->length = length;
+
+    housewiz_queue_arm (1);
+}
+
+void housewiz_queue_submit (int socket, unsigned long key,
+                            const struct sockaddr_in *destination,
+                            const char *data, int length) {
+    struct iovec part;
+    part.iov_base = (void *)data;
+    part.iov_len = length;
+    housewiz_queue_submitv (socket, key, destination, &part, 1);
+}
+
+void housewiz_queue_forget (void) {
+    int i;
+    for (i = 0; i < QueueCount; ++i)
+        QueuePool[QueueFifo[(QueueHead + i) % QueueSpace]].key = 0;
+    housewiz_queue_key_rebuild ();
+}
+
+int housewiz_queue_pending (void) {
+    return QueueCount;
+}
+
+void housewiz_queue_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-wiz-send-rate=", argv[i], &value)) {
+            QueueRate = atoi(value);
+        } else if (echttp_option_match ("-wiz-send-burst=", argv[i], &value)) {
+            QueueBurst = atoi(value);
+            if (QueueBurst < 1) QueueBurst = 1;
+        } else if (echttp_option_match ("-wiz-send-gap=", argv[i], &value)) {
+            QueueGap = atoi(value);
+        }
+    }
+    QueueTokens = QueueBurst;
+    QueueRefilled = housewiz_queue_now();
+
+    QueueTimer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (QueueTimer < 0) {
+        houselog_trace (HOUSE_FAILURE, "QUEUE",
+                        "timerfd_create() error: %s", strerror(errno));
+        return;
+    }
+    echttp_listen (QueueTimer, 1, housewiz_queue_tick, 0);
+}
+
@@ -0,0 +1,37 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_queue.h - Pace and coalesce the outgoing UDP packets.
+ *
+ */
+void housewiz_queue_initialize (int argc, const char **argv);
+
+void housewiz_queue_submit (int socket, unsigned long key,
+                            const struct sockaddr_in *destination,
+                            const char *data, int length);
+
+void housewiz_queue_submitv (int socket, unsigned long key,
+                             const struct sockaddr_in *destination,
+                             const struct iovec *parts, int count);
+
+void housewiz_queue_forget (void);
+
+int housewiz_queue_pending (void);
+
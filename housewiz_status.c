@@ -0,0 +1,193 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_status.c - Build the status of the Wiz devices.
+ *
+ * SYNOPSYS:
+ *
+ * const char *housewiz_status_export (time_t now, const char **error);
+ *
+ *    Return the JSON status of all devices. The status is rebuilt only
+ *    when a device state changed. Return a null pointer on error.
+ *
+ * const char *housewiz_status_changes (long since, const char **error);
+ *
+ *    Return the JSON status of the devices that changed since the
+ *    specified generation, and the list of the devices removed since.
+ *    Return a null pointer on error.
+ *
+ * The result is kept in a buffer that grows as needed, and is valid until
+ * the next call. There is no limit on the number of devices.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp_json.h"
+#include "houseportalclient.h"
+#include "houselog.h"
+
+#include "housewiz_device.h"
+#include "housewiz_json.h"
+#include "housewiz_status.h"
+
+
+// Add one point to the status.
+//
+static void housewiz_status_point (struct WizJson *json, int i) {
+
+    time_t pulsed = housewiz_device_deadline(i);
+    const char *status = housewiz_device_failure(i);
+    if (!status) status = housewiz_device_get(i)?"on":"off";
+    const char *commanded = housewiz_device_commanded(i)?"on":"off";
+
+    housewiz_json_object (json, housewiz_device_name(i));
+    housewiz_json_string (json, "state", status);
+    housewiz_json_string (json, "command", commanded);
+    if (pulsed)
+        housewiz_json_integer (json, "pulse", (long long)pulsed);
+    housewiz_json_string (json, "gear", "light");
+
+    const struct WizLight *light = housewiz_device_light(i);
+    if (light->dimming)
+        housewiz_json_integer (json, "dimming", light->dimming);
+    if (light->temp)
+        housewiz_json_integer (json, "temp", light->temp);
+    if (light->scene)
+        housewiz_json_integer (json, "scene", light->scene);
+    if (light->color) {
+        char color[8];
+        snprintf (color, sizeof(color), "%02x%02x%02x",
+                  light->red, light->green, light->blue);
+        housewiz_json_string (json, "color", color);
+    }
+    if (light->rssi)
+        housewiz_json_integer (json, "rssi", light->rssi);
+    housewiz_json_end (json);
+}
+
+// The status is rebuilt only when a device state changed. Otherwise only
+// the timestamp is patched in the cached copy.
+//
+static struct WizJson StatusJson;
+static char StatusHost[256];
+static char StatusProxy[256];
+static long StatusGeneration = 0;
+static char *StatusTimestamp = 0;
+static int StatusTimestampLength = 0;
+
+static int housewiz_status_patch (time_t now) {
+    char ascii[32];
+    if (!StatusTimestamp) return 0;
+    int length = snprintf (ascii, sizeof(ascii), "%ld", (long)now);
+    if (length != StatusTimestampLength) return 0;
+    memcpy (StatusTimestamp, ascii, length);
+    return 1;
+}
+
+static void housewiz_status_locate (char *buffer) {
+    StatusTimestamp = strstr (buffer, "\"timestamp\"");
+    StatusTimestampLength = 0;
+    if (!StatusTimestamp) return;
+    StatusTimestamp += sizeof("\"timestamp\"") - 1;
+    while ((*StatusTimestamp == ' ') || (*StatusTimestamp == ':'))
+        StatusTimestamp += 1;
+    while ((StatusTimestamp[StatusTimestampLength] >= '0') &&
+           (StatusTimestamp[StatusTimestampLength] <= '9'))
+        StatusTimestampLength += 1;
+    if (!StatusTimestampLength) StatusTimestamp = 0;
+}
+
+const char *housewiz_status_export (time_t now, const char **error) {
+    int count = housewiz_device_count();
+    int i;
+
+    long generation = housewiz_device_generation();
+    const char *host = houselog_host();
+    const char *proxy = houseportal_server();
+
+    if ((generation == StatusGeneration) &&
+        (!strcmp (host, StatusHost)) && (!strcmp (proxy, StatusProxy))) {
+        if (housewiz_status_patch (now)) return StatusJson.buffer;
+    }
+
+    StatusTimestamp = 0; // The buffer may move.
+    housewiz_json_start (&StatusJson);
+    housewiz_json_object (&StatusJson, 0);
+    housewiz_json_string (&StatusJson, "host", host);
+    housewiz_json_string (&StatusJson, "proxy", proxy);
+    housewiz_json_integer (&StatusJson, "timestamp", (long long)now);
+    housewiz_json_integer (&StatusJson, "epoch", (long long)housewiz_device_epoch());
+    housewiz_json_integer (&StatusJson, "generation", generation);
+    housewiz_json_object (&StatusJson, "control");
+    housewiz_json_object (&StatusJson, "status");
+
+    for (i = 0; i < count; ++i) housewiz_status_point (&StatusJson, i);
+
+    char *buffer = (char *)housewiz_json_export (&StatusJson, error);
+    if (!buffer) {
+        StatusGeneration = 0;
+        return 0;
+    }
+    StatusGeneration = generation;
+    snprintf (StatusHost, sizeof(StatusHost), "%s", host);
+    snprintf (StatusProxy, sizeof(StatusProxy), "%s", proxy);
+    housewiz_status_locate (buffer);
+    return buffer;
+}
+
+// A client that provides the generation of the last status it received
+// only gets the points that changed since, and the list of points that
+// were removed.
+//
+const char *housewiz_status_changes (long since, const char **error) {
+    static struct WizJson json;
+    int count = housewiz_device_count();
+    int cursor = 0;
+    int i;
+
+    housewiz_json_start (&json);
+    housewiz_json_object (&json, 0);
+    housewiz_json_string (&json, "host", houselog_host());
+    housewiz_json_string (&json, "proxy", houseportal_server());
+    housewiz_json_integer (&json, "timestamp", (long long)time(0));
+    housewiz_json_integer (&json, "epoch", (long long)housewiz_device_epoch());
+    housewiz_json_integer (&json, "generation", housewiz_device_generation());
+    housewiz_json_integer (&json, "since", since);
+    housewiz_json_object (&json, "control");
+    housewiz_json_object (&json, "status");
+
+    for (i = 0; i < count; ++i) {
+        if (housewiz_device_stamp(i) > since)
+            housewiz_status_point (&json, i);
+    }
+    housewiz_json_end (&json);
+
+    const char *name = housewiz_device_removed (since, &cursor);
+    if (name) {
+        housewiz_json_array (&json, "removed");
+        for (; name; name = housewiz_device_removed (since, &cursor))
+            housewiz_json_string (&json, 0, name);
+        housewiz_json_end (&json);
+    }
+    return housewiz_json_export (&json, error);
+}
+
@@ -0,0 +1,296 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_store.c - Store the configuration without blocking the main loop.
+ *
+ * SYNOPSYS:
+ *
+ * Updating the configuration writes it to disk, which can be slow. This
+ * module hands off the configuration updates to a worker thread, so that
+ * the main loop keeps servicing the devices and the web clients.
+ *
+ * Only the worker thread calls houseconfig_update(). The main thread only
+ * reads the configuration from within the completion callback, when the
+ * worker is known to be idle, or before this module is initialized. The
+ * name of the configuration is recorded at initialization, so that it
+ * can be used at any time.
+ *
+ * There is at most one update waiting: each update is a full configuration
+ * that supersedes any previous one still waiting, so a newer update
+ * replaces the waiting one (the flags are merged).
+ *
+ * void housewiz_store_initialize (housewiz_store_done *done);
+ *
+ *    Start the worker thread. The done callback is called from the main
+ *    loop after the configuration was stored, with the flags and data of
+ *    the requests that were completed. If the worker thread cannot be
+ *    started, the configuration is stored synchronously.
+ *
+ * const char *housewiz_store_submit (const char *data, int length,
+ *                                    int flags, const char *reason);
+ *
+ *    Queue a new configuration to store. The data is copied. Return an
+ *    error message if the data is not valid JSON, a null pointer otherwise.
+ *    Each configuration accepted gets a new request number.
+ *
+ * long housewiz_store_request (void);
+ *
+ *    Return the number of the last request accepted.
+ *
+ * const char *housewiz_store_outcome (long request, const char **error);
+ *
+ *    Return "pending", "stored" or "failed" for the specified request.
+ *    A request superseded by a newer one that was stored is considered
+ *    stored. The error is set when the request failed.
+ *
+ * const char *housewiz_store_name (void);
+ *
+ *    Return the name of the configuration, as recorded at initialization.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houseconfig.h"
+#include "houselog.h"
+
+#include "housewiz_store.h"
+
+struct StoreRequest {
+    long id;
+    char *data;
+    int length;
+    int flags;
+    char reason[64];
+};
+
+static housewiz_store_done *StoreDoneCallback = 0;
+
+static pthread_mutex_t StoreConfigLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t StoreQueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  StoreWakeup = PTHREAD_COND_INITIALIZER;
+
+// All the following items are protected by StoreQueueLock.
+static struct StoreRequest StorePending;
+static struct StoreRequest StoreDone;
+static char StoreError[128];
+static long StoreApplied = 0;
+static long StoreFailed = 0;
+static char StoreFailure[128]; // The error of request StoreFailed.
+
+static long StoreSubmitted = 0; // Main thread only.
+static char StoreName[128];
+
+static int StoreSignal[2] = {-1, -1};
+static int StoreThreaded = 0;
+
+
+static void housewiz_store_merge (struct StoreRequest *into,
+                                  struct StoreRequest *from) {
+    free (into->data);
+    into->id = from->id;
+    into->data = from->data;
+    into->length = from->length;
+    into->flags |= from->flags;
+    if (from->reason[0])
+        snprintf (into->reason, sizeof(into->reason), "%s", from->reason);
+    from->data = 0;
+    from->flags = 0;
+    from->reason[0] = 0;
+}
+
+static void *housewiz_store_worker (void *unused) {
+
+    for (;;) {
+        struct StoreRequest request;
+
+        pthread_mutex_lock (&StoreQueueLock);
+        while (!StorePending.data)
+            pthread_cond_wait (&StoreWakeup, &StoreQueueLock);
+        request = StorePending;
+        StorePending.data = 0;
+        StorePending.flags = 0;
+        StorePending.reason[0] = 0;
+        pthread_mutex_unlock (&StoreQueueLock);
+
+        pthread_mutex_lock (&StoreConfigLock);
+        const char *error = houseconfig_update (request.data);
+        pthread_mutex_unlock (&StoreConfigLock);
+
+        pthread_mutex_lock (&StoreQueueLock);
+        if (error) {
+            snprintf (StoreError, sizeof(StoreError), "%s", error);
+            snprintf (StoreFailure, sizeof(StoreFailure), "%s", error);
+            StoreFailed = request.id;
+            free (request.data);
+        } else {
+            StoreApplied = request.id;
+            housewiz_store_merge (&StoreDone, &request);
+        }
+        pthread_mutex_unlock (&StoreQueueLock);
+
+        if (write (StoreSignal[1], "", 1) < 0) {
+            // The pipe is full: the main loop was already signaled.
+        }
+    }
+    return 0;
+}
+
+static void housewiz_store_complete (int fd, int mode) {
+
+    char drain[64];
+    char error[128];
+    struct StoreRequest done = {0};
+
+    while (read (fd, drain, sizeof(drain)) > 0) ;
+
+    // If the worker is busy with a newer update, it will signal again
+    // when done: do not wait for it.
+    //
+    if (pthread_mutex_trylock (&StoreConfigLock)) return;
+
+    pthread_mutex_lock (&StoreQueueLock);
+    housewiz_store_merge (&done, &StoreDone);
+    StoreDone.flags = 0;
+    snprintf (error, sizeof(error), "%s", StoreError);
+    StoreError[0] = 0;
+    pthread_mutex_unlock (&StoreQueueLock);
+
+    if (error[0])
+        houselog_trace (HOUSE_FAILURE, "CONFIG", "cannot store: %s", error);
+    if (done.data && StoreDoneCallback)
+        StoreDoneCallback (done.reason, done.data, done.length, done.flags);
+    pthread_mutex_unlock (&StoreConfigLock);
+
+    free (done.data);
+}
+
+static const char *housewiz_store_check (const char *data, int length) {
+
+    // Parsing is destructive: work on a copy. A JSON token cannot be
+    // shorter than one character, plus its separator.
+    //
+    int count = length / 2 + 16;
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    char *copy = malloc (length + 1);
+    const char *error = "no more memory";
+    if (tokens && copy) {
+        memcpy (copy, data, length);
+        copy[length] = 0;
+        error = echttp_json_parse (copy, tokens, &count);
+    }
+    free (copy);
+    free (tokens);
+    return error;
+}
+
+const char *housewiz_store_submit (const char *data, int length,
+                                   int flags, const char *reason) {
+
+    const char *error = housewiz_store_check (data, length);
+    if (error) return error;
+
+    if (!StoreThreaded) {
+        error = houseconfig_update (data);
+        if (error) return error;
+        StoreApplied = ++StoreSubmitted;
+        if (StoreDoneCallback) StoreDoneCallback (reason, data, length, flags);
+        return 0;
+    }
+
+    struct StoreRequest request;
+    request.id = ++StoreSubmitted;
+    request.data = malloc (length + 1);
+    if (!request.data) return "no more memory";
+    memcpy (request.data, data, length);
+    request.data[length] = 0;
+    request.length = length;
+    request.flags = flags;
+    snprintf (request.reason, sizeof(request.reason), "%s", reason);
+
+    pthread_mutex_lock (&StoreQueueLock);
+    if (StorePending.data && echttp_isdebug())
+        fprintf (stderr, "Configuration update superseded by %s\n", reason);
+    housewiz_store_merge (&StorePending, &request);
+    pthread_cond_signal (&StoreWakeup);
+    pthread_mutex_unlock (&StoreQueueLock);
+    return 0;
+}
+
+long housewiz_store_request (void) {
+    return StoreSubmitted;
+}
+
+const char *housewiz_store_outcome (long request, const char **error) {
+
+    static char failure[128];
+    const char *outcome = "pending";
+
+    *error = 0;
+    pthread_mutex_lock (&StoreQueueLock);
+    if ((StoreFailed >= request) && (StoreFailed > StoreApplied)) {
+        snprintf (failure, sizeof(failure), "%s", StoreFailure);
+        *error = failure;
+        outcome = "failed";
+    } else if (StoreApplied >= request) {
+        outcome = "stored";
+    }
+    pthread_mutex_unlock (&StoreQueueLock);
+    return outcome;
+}
+
+const char *housewiz_store_name (void) {
+    return StoreName;
+}
+
+void housewiz_store_initialize (housewiz_store_done *done) {
+
+    pthread_t worker;
+
+    StoreDoneCallback = done;
+    snprintf (StoreName, sizeof(StoreName), "%s", houseconfig_name());
+
+    if (pipe (StoreSignal) < 0) {
+        houselog_trace (HOUSE_FAILURE, "CONFIG",
+                        "pipe() error: %s", strerror(errno));
+        return;
+    }
+    fcntl (StoreSignal[0], F_SETFL, O_NONBLOCK);
+    fcntl (StoreSignal[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create (&worker, 0, housewiz_store_worker, 0)) {
+        houselog_trace (HOUSE_FAILURE, "CONFIG",
+                        "cannot start the storage thread");
+        close (StoreSignal[0]);
+        close (StoreSignal[1]);
+        return;
+    }
+    pthread_detach (worker);
+    echttp_listen (StoreSignal[0], 1, housewiz_store_complete, 0);
+    StoreThreaded = 1;
+}
+
@@ -0,0 +1,39 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_store.h - Store the configuration without blocking the main loop.
+ *
+ */
+#define WIZ_STORE_REFRESH 1 // Reload the devices from the new configuration.
+#define WIZ_STORE_PUBLISH 2 // Send the new configuration to the depot.
+
+typedef void housewiz_store_done (const char *reason,
+                                  const char *data, int length, int flags);
+
+void housewiz_store_initialize (housewiz_store_done *done);
+
+const char *housewiz_store_submit (const char *data, int length,
+                                   int flags, const char *reason);
+
+long housewiz_store_request (void);
+const char *housewiz_store_outcome (long request, const char **error);
+
+const char *housewiz_store_name (void);
+
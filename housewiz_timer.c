@@ -0,0 +1,175 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housewiz_timer.c - A min-heap of timers, one per numbered item.
+ *
+ * SYNOPSYS:
+ *
+ * This module keeps track of when each item (typically a device) needs
+ * attention next, so that the periodic processing only visits the items
+ * that are due. The time unit is left to the caller.
+ *
+ * void housewiz_timer_reset (void);
+ *
+ *    Cancel all timers.
+ *
+ * void housewiz_timer_set (int id, long long due);
+ *
+ *    Set (or move) the timer for the specified item.
+ *
+ * void housewiz_timer_cancel (int id);
+ *
+ *    Cancel the timer for the specified item, if any.
+ *
+ * int housewiz_timer_expired (long long now);
+ *
+ *    Return the ID of one item which timer expired, or -1 if none.
+ *    The timer of the returned item is cancelled.
+ *
+ * long long housewiz_timer_next (void);
+ *
+ *    Return the earliest due time, or 0 if there is no timer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "houselog.h"
+
+#include "housewiz_timer.h"
+
+struct TimerEntry {
+    long long due;
+    int id;
+};
+
+static struct TimerEntry *TimerHeap = 0;
+static int TimerCount = 0;
+static int TimerHeapSpace = 0;
+
+static int *TimerPosition = 0; // Heap index for each ID, -1 if none.
+static int TimerPositionSpace = 0;
+
+
+static void *housewiz_timer_grow (void *data, int *space, int needed, int size) {
+    int newspace = (*space > 0) ? *space : 64;
+    while (newspace <= needed) newspace *= 2;
+    void *newdata = realloc (data, newspace * size);
+    if (!newdata) {
+        houselog_trace (HOUSE_FAILURE, "TIMER", "no more memory");
+        exit(1);
+    }
+    *space = newspace;
+    return newdata;
+}
+
+static void housewiz_timer_place (int index, struct TimerEntry entry) {
+    TimerHeap[index] = entry;
+    TimerPosition[entry.id] = index;
+}
+
+static void housewiz_timer_up (int index) {
+    struct TimerEntry entry = TimerHeap[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (TimerHeap[parent].due <= entry.due) break;
+        housewiz_timer_place (index, TimerHeap[parent]);
+        index = parent;
+    }
+    housewiz_timer_place (index, entry);
+}
+
+static void housewiz_timer_down (int index) {
+    struct TimerEntry entry = TimerHeap[index];
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= TimerCount) break;
+        if ((child + 1 < TimerCount) &&
+            (TimerHeap[child+1].due < TimerHeap[child].due)) child += 1;
+        if (entry.due <= TimerHeap[child].due) break;
+        housewiz_timer_place (index, TimerHeap[child]);
+        index = child;
+    }
+    housewiz_timer_place (index, entry);
+}
+
+void housewiz_timer_reset (void) {
+    int i;
+    for (i = 0; i < TimerCount; ++i) TimerPosition[TimerHeap[i].id] = -1;
+    TimerCount = 0;
+}
+
+void housewiz_timer_set (int id, long long due) {
+
+    if (id < 0) return;
+
+    if (id >= TimerPositionSpace) {
+        int i;
+        int oldspace = TimerPositionSpace;
+        TimerPosition = housewiz_timer_grow (TimerPosition,
+                                             &TimerPositionSpace, id, sizeof(int));
+        for (i = oldspace; i < TimerPositionSpace; ++i) TimerPosition[i] = -1;
+    }
+
+    int index = TimerPosition[id];
+    if (index < 0) {
+        if (TimerCount >= TimerHeapSpace)
+            TimerHeap = housewiz_timer_grow (TimerHeap, &TimerHeapSpace,
+                                             TimerCount, sizeof(TimerHeap[0]));
+        index = TimerCount++;
+        TimerHeap[index].id = id;
+        TimerHeap[index].due = due;
+        housewiz_timer_up (index);
+        return;
+    }
+    long long previous = TimerHeap[index].due;
+    TimerHeap[index].due = due;
+    if (due < previous) housewiz_timer_up (index);
+    else if (due > previous) housewiz_timer_down (index);
+}
+
+void housewiz_timer_cancel (int id) {
+
+    if ((id < 0) || (id >= TimerPositionSpace)) return;
+    int index = TimerPosition[id];
+    if (index < 0) return;
+
+    TimerPosition[id] = -1;
+    if (--TimerCount == index) return; // This was the last entry.
+
+    long long previous = TimerHeap[index].due;
+    housewiz_timer_place (index, TimerHeap[TimerCount]);
+    if (TimerHeap[index].due < previous) housewiz_timer_up (index);
+    else housewiz_timer_down (index);
+}
+
+int housewiz_timer_expired (long long now) {
+    if (TimerCount <= 0) return -1;
+    if (TimerHeap[0].due > now) return -1;
+    int id = TimerHeap[0].id;
+    housewiz_timer_cancel (id);
+    return id;
+}
+
+long long housewiz_timer_next (void) {
+    if (TimerCount <= 0) return 0;
+    return TimerHeap[0].due;
+}
+
@@ -0,0 +1,339 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * wizbench.c - Measure the performance of housewiz, typically with wizsim.
+ *
+ * SYNOPSYS:
+ *
+ * wizbench -server=HOST:PORT [-devices=N] [-rounds=N] [-pid=N]
+ *          [-timeout=SECONDS]
+ *
+ * This program uses the housewiz web API to measure:
+ * - the time it takes for housewiz to detect the specified number of
+ *   devices (start housewiz and wizbench at the same time),
+ * - the time from a command to all devices to the confirmation of the
+ *   new state by all devices, over several rounds,
+ * - the command-to-confirm latency percentiles, as measured by housewiz,
+ * - the CPU time used by housewiz per packet received (requires -pid).
+ *
+ * This program does not use any housewiz module, or any library other
+ * than the C library.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define WIZBENCH_BUCKETS 17
+
+static char BenchHost[256] = "127.0.0.1";
+static char BenchPort[16] = "80";
+static int BenchDevices = 1000;
+static int BenchRounds = 5;
+static int BenchPid = 0;
+static int BenchTimeout = 120;
+
+static char *BenchResponse = 0;
+static int BenchResponseSpace = 0;
+
+
+static long long wizbench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// A minimal HTTP client: housewiz always provides a Content-Length,
+// and the connection is closed after each request.
+//
+static const char *wizbench_get (const char *uri) {
+
+    struct addrinfo hints;
+    struct addrinfo *server;
+    char request[1024];
+    int length = 0;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (BenchHost, BenchPort, &hints, &server)) return 0;
+
+    int s = socket (AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        freeaddrinfo (server);
+        return 0;
+    }
+    if (connect (s, server->ai_addr, server->ai_addrlen) < 0) {
+        freeaddrinfo (server);
+        close (s);
+        return 0;
+    }
+    freeaddrinfo (server);
+
+    snprintf (request, sizeof(request),
+              "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+              uri, BenchHost);
+    if (write (s, request, strlen(request)) < 0) {
+        close (s);
+        return 0;
+    }
+
+    for (;;) {
+        if (length + 4096 >= BenchResponseSpace) {
+            int space = BenchResponseSpace + 65536;
+            char *buffer = realloc (BenchResponse, space);
+            if (!buffer) break;
+            BenchResponse = buffer;
+            BenchResponseSpace = space;
+        }
+        int count = read (s, BenchResponse + length,
+                          BenchResponseSpace - length - 1);
+        if (count <= 0) break;
+        length += count;
+    }
+    close (s);
+    if (!BenchResponse) return 0;
+    BenchResponse[length] = 0;
+
+    char *body = strstr (BenchResponse, "\r\n\r\n");
+    return body ? body + 4 : 0;
+}
+
+// Count the points which state matches the specified value. A null
+// value matches any healthy state.
+//
+static int wizbench_count (const char *status, const char *value) {
+
+    int count = 0;
+    const char *p = status;
+
+    while ((p = strstr (p, "\"state\"")) != 0) {
+        p += 7;
+        while ((*p == ' ') || (*p == ':')) p += 1;
+        if (value) {
+            int length = strlen(value);
+            if ((p[0] == '"') && (!strncmp (p+1, value, length)) &&
+                (p[length+1] == '"')) count += 1;
+        } else if ((!strncmp (p, "\"on\"", 4)) || (!strncmp (p, "\"off\"", 5))) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+// Retrieve one metric from the Prometheus text format.
+//
+static unsigned long wizbench_metric (const char *metrics, const char *name) {
+    const char *p = metrics;
+    int length = strlen(name);
+    while ((p = strstr (p, name)) != 0) {
+        if (((p == metrics) || (p[-1] == '\n')) &&
+            ((p[length] == ' ') || (p[length] == '{'))) {
+            const char *value = strchr (p, ' ');
+            if (value) return strtoul (value + 1, 0, 10);
+        }
+        p += length;
+    }
+    return 0;
+}
+
+static void wizbench_latency (const char *metrics,
+                              unsigned long *buckets, long long *bounds) {
+    const char *p = metrics;
+    int i = 0;
+    static const char name[] = "wiz_command_latency_ms_bucket{le=\"";
+    while ((i < WIZBENCH_BUCKETS) && (p = strstr (p, name)) != 0) {
+        p += sizeof(name) - 1;
+        bounds[i] = (*p == '+') ? -1 : atoll(p);
+        const char *value = strchr (p, ' ');
+        if (!value) break;
+        buckets[i++] = strtoul (value + 1, 0, 10);
+    }
+}
+
+static long long wizbench_percentile (const unsigned long *before,
+                                      const unsigned long *after,
+                                      const long long *bounds, int percent) {
+    int i;
+    unsigned long total = after[WIZBENCH_BUCKETS-1] - before[WIZBENCH_BUCKETS-1];
+    if (!total) return 0;
+    for (i = 0; i < WIZBENCH_BUCKETS; ++i) {
+        unsigned long count = after[i] - before[i]; // Cumulative.
+        if (count * 100 >= total * percent) return bounds[i];
+    }
+    return -1;
+}
+
+static long long wizbench_cpu (void) {
+
+    char path[64];
+    char buffer[1024];
+    unsigned long user;
+    unsigned long system;
+
+    if (BenchPid <= 0) return -1;
+
+    snprintf (path, sizeof(path), "/proc/%d/stat", BenchPid);
+    FILE *f = fopen (path, "r");
+    if (!f) return -1;
+    if (!fgets (buffer, sizeof(buffer), f)) buffer[0] = 0;
+    fclose (f);
+
+    // The command name can include spaces: skip to after it.
+    const char *p = strrchr (buffer, ')');
+    if (!p) return -1;
+    if (sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &user, &system) != 2) return -1;
+    return (long long)(user + system) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static int wizbench_option (const char *name, const char *arg,
+                            const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, name, length)) return 0;
+    *value = arg + length;
+    return 1;
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    const char *status;
+    const char *metrics;
+    unsigned long before[WIZBENCH_BUCKETS] = {0};
+    unsigned long after[WIZBENCH_BUCKETS] = {0};
+    long long bounds[WIZBENCH_BUCKETS] = {0};
+
+    for (i = 1; i < argc; ++i) {
+        if (wizbench_option ("-server=", argv[i], &value)) {
+            const char *port = strchr (value, ':');
+            if (port) {
+                snprintf (BenchHost, sizeof(BenchHost), "%.*s",
+                          (int)(port - value), value);
+                snprintf (BenchPort, sizeof(BenchPort), "%s", port + 1);
+            } else {
+                snprintf (BenchHost, sizeof(BenchHost), "%s", value);
+            }
+        } else if (wizbench_option ("-devices=", argv[i], &value)) {
+            BenchDevices = atoi(value);
+        } else if (wizbench_option ("-rounds=", argv[i], &value)) {
+            BenchRounds = atoi(value);
+        } else if (wizbench_option ("-pid=", argv[i], &value)) {
+            BenchPid = atoi(value);
+        } else if (wizbench_option ("-timeout=", argv[i], &value)) {
+            BenchTimeout = atoi(value);
+        } else {
+            fprintf (stderr, "invalid option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    // Discovery.
+    //
+    long long start = wizbench_now();
+    long long deadline = start + 1000LL * BenchTimeout;
+    int detected = 0;
+    while (wizbench_now() < deadline) {
+        status = wizbench_get ("/wiz/status");
+        if (status) detected = wizbench_count (status, 0);
+        if (detected >= BenchDevices) break;
+        usleep (200000);
+    }
+    printf ("discovery: %d devices detected in %lld ms\n",
+            detected, wizbench_now() - start);
+    if (detected < BenchDevices) {
+        printf ("timeout: only %d out of %d devices detected\n",
+                detected, BenchDevices);
+        exit(1);
+    }
+
+    metrics = wizbench_get ("/wiz/metrics?format=prometheus");
+    if (!metrics) {
+        fprintf (stderr, "cannot get metrics\n");
+        exit(1);
+    }
+    wizbench_latency (metrics, before, bounds);
+    unsigned long packets = wizbench_metric (metrics, "wiz_packets_received_total");
+    long long cpu = wizbench_cpu ();
+
+    // Command rounds: all devices on, then all off, etc.
+    //
+    long long slowest = 0;
+    long long total = 0;
+    for (i = 0; i < BenchRounds; ++i) {
+        const char *state = (i % 2) ? "off" : "on";
+        char uri[64];
+        snprintf (uri, sizeof(uri), "/wiz/set?point=all&state=%s", state);
+        start = wizbench_now();
+        deadline = start + 1000LL * BenchTimeout;
+        if (!wizbench_get (uri)) {
+            fprintf (stderr, "cannot send command\n");
+            exit(1);
+        }
+        int confirmed = 0;
+        while (wizbench_now() < deadline) {
+            status = wizbench_get ("/wiz/status");
+            if (status) confirmed = wizbench_count (status, state);
+            if (confirmed >= detected) break;
+            usleep (50000);
+        }
+        long long elapsed = wizbench_now() - start;
+        printf ("round %d: %d devices %s in %lld ms\n",
+                i + 1, confirmed, state, elapsed);
+        if (elapsed > slowest) slowest = elapsed;
+        total += elapsed;
+    }
+    if (BenchRounds > 0)
+        printf ("command to all devices: average %lld ms, slowest %lld ms\n",
+                total / BenchRounds, slowest);
+
+    metrics = wizbench_get ("/wiz/metrics?format=prometheus");
+    if (!metrics) {
+        fprintf (stderr, "cannot get metrics\n");
+        exit(1);
+    }
+    wizbench_latency (metrics, after, bounds);
+    packets = wizbench_metric (metrics, "wiz_packets_received_total") - packets;
+
+    printf ("command-to-confirm latency: p50 <= %lld ms, p90 <= %lld ms, "
+            "p99 <= %lld ms (-1 means more than %lld ms)\n",
+            wizbench_percentile (before, after, bounds, 50),
+            wizbench_percentile (before, after, bounds, 90),
+            wizbench_percentile (before, after, bounds, 99),
+            bounds[WIZBENCH_BUCKETS-2]);
+
+    if (cpu >= 0) {
+        long long used = wizbench_cpu () - cpu;
+        printf ("cpu: %lld us for %lu packets received", used, packets);
+        if (packets > 0) printf (" (%.1f us per packet)", (double)used / packets);
+        printf ("\n");
+    }
+    return 0;
+}
+
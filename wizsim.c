@@ -0,0 +1,439 @@
+/* HouseWiz - A simple home web server for control of Philips Wiz devices.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * wizsim.c - Simulate a large number of Wiz devices, for testing.
+ *
+ * SYNOPSYS:
+ *
+ * wizsim [-devices=N] [-base=ADDRESS] [-loss=PERCENT] [-latency=MS]
+ *        [-jitter=MS] [-reboot=SECONDS] [-seed=N]
+ *
+ * Each simulated device has its own IP address, starting after the base
+ * address (default 127.1.0.0): all the 127.x.x.x addresses are local on
+ * Linux, so the simulator and housewiz can run on the same machine. All
+ * devices share a single UDP socket on port 38899, and the destination
+ * address of each received packet identifies the device. A broadcast
+ * is answered by all devices.
+ *
+ * The simulated devices answer registration with syncPilot, apply
+ * setPilot and report their new state with syncPilot. When -reboot is
+ * used, each device reboots at random, on average every N seconds, and
+ * then sends firstBeat messages.
+ *
+ * The -loss option drops the given percentage of the received and sent
+ * packets. The -latency and -jitter options delay the answers.
+ *
+ * This program does not use any housewiz module, or any library other
+ * than the C library.
+ */
+
+#define _GNU_SOURCE // For IP_PKTINFO.
+
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define WIZSIM_PORT 38899
+#define WIZSIM_FIRSTBEATS 3 // Real devices send these for a while.
+
+#define WIZSIM_SYNC      0
+#define WIZSIM_RESULT    1
+#define WIZSIM_FIRSTBEAT 2
+
+struct SimDevice {
+    char mac[16];
+    char state;
+    char firstbeats; // Count of firstBeat messages left to send.
+};
+
+struct SimReply {
+    long long due;
+    int device;
+    int kind;
+    int id;
+    struct sockaddr_in destination;
+};
+
+static struct SimDevice *Devices = 0;
+static int DevicesCount = 1000;
+static in_addr_t DevicesBase = 0;
+
+static int SimLoss = 0;     // Percent.
+static int SimLatency = 0;  // Milliseconds.
+static int SimJitter = 0;   // Milliseconds.
+static int SimReboot = 0;   // Seconds, 0 means never.
+
+static int SimSocket = -1;
+static struct sockaddr_in SimController; // Last known housewiz address.
+
+static struct SimReply *Replies = 0; // A min-heap ordered by due time.
+static int RepliesCount = 0;
+static int RepliesSpace = 0;
+
+static unsigned long SimReceived = 0;
+static unsigned long SimSent = 0;
+static unsigned long SimLost = 0;
+static unsigned long SimRebooted = 0;
+
+
+static long long wizsim_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int wizsim_lost (void) {
+    if (SimLoss <= 0) return 0;
+    if ((rand() % 100) >= SimLoss) return 0;
+    SimLost += 1;
+    return 1;
+}
+
+static void wizsim_heap_swap (int a, int b) {
+    struct SimReply save = Replies[a];
+    Replies[a] = Replies[b];
+    Replies[b] = save;
+}
+
+static void wizsim_queue (int device, int kind, int id,
+                          const struct sockaddr_in *destination) {
+
+    if (RepliesCount >= RepliesSpace) {
+        int space = RepliesSpace ? 2 * RepliesSpace : 1024;
+        struct SimReply *replies = realloc (Replies, space * sizeof(*Replies));
+        if (!replies) return; // Act as if lost.
+        Replies = replies;
+        RepliesSpace = space;
+    }
+    int i = RepliesCount++;
+    Replies[i].due = wizsim_now() + SimLatency;
+    if (SimJitter > 0) Replies[i].due += rand() % SimJitter;
+    Replies[i].device = device;
+    Replies[i].kind = kind;
+    Replies[i].id = id;
+    Replies[i].destination = *destination;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (Replies[parent].due <= Replies[i].due) break;
+        wizsim_heap_swap (i, parent);
+        i = parent;
+    }
+}
+
+static void wizsim_dequeue (void) {
+    int i = 0;
+    Replies[0] = Replies[--RepliesCount];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= RepliesCount) break;
+        if ((child + 1 < RepliesCount) &&
+            (Replies[child+1].due < Replies[child].due)) child += 1;
+        if (Replies[i].due <= Replies[child].due) break;
+        wizsim_heap_swap (i, child);
+        i = child;
+    }
+}
+
+// Send from the device's own address, using IP_PKTINFO.
+//
+static void wizsim_send (int device, const struct sockaddr_in *destination,
+                         const char *data) {
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(struct in_pktinfo))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+
+    if (wizsim_lost()) return;
+
+    memset (&control, 0, sizeof(control));
+    iov.iov_base = (char *)data;
+    iov.iov_len = strlen(data);
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_name = (struct sockaddr *)destination;
+    msg.msg_namelen = sizeof(*destination);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+    info->ipi_spec_dst.s_addr = htonl(ntohl(DevicesBase) + device + 1);
+
+    if (sendmsg (SimSocket, &msg, 0) < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            fprintf (stderr, "sendmsg() error: %s\n", strerror(errno));
+        return;
+    }
+    SimSent += 1;
+}
+
+static void wizsim_reply (const struct SimReply *reply) {
+
+    char buffer[512];
+    struct SimDevice *device = Devices + reply->device;
+
+    switch (reply->kind) {
+    case WIZSIM_SYNC:
+        snprintf (buffer, sizeof(buffer),
+                  "{\"method\":\"syncPilot\",\"env\":\"pro\",\"params\":"
+                  "{\"mac\":\"%s\",\"rssi\":-%d,\"src\":\"udp\","
+                  "\"state\":%s,\"sceneId\":0,\"dimming\":100}}",
+                  device->mac, 40 + (reply->device % 40),
+                  device->state ? "true" : "false");
+        break;
+    case WIZSIM_RESULT:
+        snprintf (buffer, sizeof(buffer),
+                  "{\"method\":\"setPilot\",\"id\":%d,\"env\":\"pro\","
+                  "\"result\":{\"success\":true}}", reply->id);
+        break;
+    case WIZSIM_FIRSTBEAT:
+        snprintf (buffer, sizeof(buffer),
+                  "{\"method\":\"firstBeat\",\"env\":\"pro\",\"params\":"
+                  "{\"mac\":\"%s\",\"homeId\":0,\"fwVersion\":\"1.22.0\"}}",
+                  device->mac);
+        break;
+    default:
+        return;
+    }
+    wizsim_send (reply->device, &(reply->destination), buffer);
+}
+
+// A minimal decoder that only looks for the few items used here.
+//
+static const char *wizsim_value (const char *data, const char *name) {
+    const char *p = strstr (data, name);
+    if (!p) return 0;
+    p += strlen(name);
+    while ((*p == ' ') || (*p == ':') || (*p == '"')) p += 1;
+    return p;
+}
+
+static void wizsim_device_receive (int device, const char *data,
+                                   const struct sockaddr_in *source) {
+
+    const char *method = wizsim_value (data, "\"method\"");
+    if (!method) return;
+
+    if (!strncmp (method, "registration", 12)) {
+        wizsim_queue (device, WIZSIM_SYNC, 0, source);
+    } else if (!strncmp (method, "setPilot", 8)) {
+        const char *id = wizsim_value (data, "\"id\"");
+        const char *state = wizsim_value (data, "\"state\"");
+        if (state) Devices[device].state = (!strncmp (state, "true", 4));
+        wizsim_queue (device, WIZSIM_RESULT, id ? atoi(id) : 0, source);
+        wizsim_queue (device, WIZSIM_SYNC, 0, source);
+    }
+}
+
+static void wizsim_receive (void) {
+
+    char data[1024];
+    union {
+        char buffer[CMSG_SPACE(sizeof(struct in_pktinfo))];
+        struct cmsghdr align;
+    } control;
+    struct sockaddr_in source;
+    struct iovec iov;
+    struct msghdr msg;
+    int i;
+
+    for (;;) {
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data) - 1;
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_name = &source;
+        msg.msg_namelen = sizeof(source);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        int length = recvmsg (SimSocket, &msg, MSG_DONTWAIT);
+        if (length <= 0) return;
+        data[length] = 0;
+        SimReceived += 1;
+        if (wizsim_lost()) continue;
+
+        in_addr_t destination = INADDR_BROADCAST;
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level == IPPROTO_IP) &&
+                (cmsg->cmsg_type == IP_PKTINFO)) {
+                struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+                destination = ntohl(info->ipi_addr.s_addr);
+            }
+        }
+        SimController = source;
+
+        long device = (long)destination - (long)ntohl(DevicesBase) - 1;
+        if ((device >= 0) && (device < DevicesCount)) {
+            wizsim_device_receive ((int)device, data, &source);
+        } else {
+            // Not addressed to a specific device: everybody answers.
+            for (i = 0; i < DevicesCount; ++i)
+                wizsim_device_receive (i, data, &source);
+        }
+    }
+}
+
+// Called every second.
+//
+static void wizsim_periodic (time_t now) {
+
+    static time_t LastReport = 0;
+    int i;
+
+    for (i = 0; i < DevicesCount; ++i) {
+        struct SimDevice *device = Devices + i;
+        if (SimReboot > 0 && (rand() % SimReboot) == 0) {
+            device->state = 0;
+            device->firstbeats = WIZSIM_FIRSTBEATS;
+            SimRebooted += 1;
+        }
+        if (device->firstbeats > 0) {
+            device->firstbeats -= 1;
+            if (SimController.sin_port)
+                wizsim_queue (i, WIZSIM_FIRSTBEAT, 0, &SimController);
+        }
+    }
+
+    if (now >= LastReport + 10) {
+        fprintf (stderr, "received %lu, sent %lu, lost %lu, rebooted %lu, "
+                         "queued %d\n",
+                 SimReceived, SimSent, SimLost, SimRebooted, RepliesCount);
+        LastReport = now;
+    }
+}
+
+static const char *wizsim_option (const char *name, const char *arg) {
+    int length = strlen(name);
+    if (strncmp (arg, name, length)) return 0;
+    return arg + length;
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    unsigned int seed = time(0) ^ getpid();
+
+    DevicesBase = inet_addr ("127.1.0.0");
+
+    for (i = 1; i < argc; ++i) {
+        if ((value = wizsim_option ("-devices=", argv[i]))) {
+            DevicesCount = atoi(value);
+        } else if ((value = wizsim_option ("-base=", argv[i]))) {
+            DevicesBase = inet_addr (value);
+        } else if ((value = wizsim_option ("-loss=", argv[i]))) {
+            SimLoss = atoi(value);
+        } else if ((value = wizsim_option ("-latency=", argv[i]))) {
+            SimLatency = atoi(value);
+        } else if ((value = wizsim_option ("-jitter=", argv[i]))) {
+            SimJitter = atoi(value);
+        } else if ((value = wizsim_option ("-reboot=", argv[i]))) {
+            SimReboot = atoi(value);
+        } else if ((value = wizsim_option ("-seed=", argv[i]))) {
+            seed = atoi(value);
+        } else {
+            fprintf (stderr, "invalid option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (DevicesCount <= 0) DevicesCount = 1;
+    srand (seed);
+    signal (SIGPIPE, SIG_IGN);
+
+    Devices = calloc (DevicesCount, sizeof(struct SimDevice));
+    if (!Devices) {
+        fprintf (stderr, "no more memory\n");
+        exit(1);
+    }
+    for (i = 0; i < DevicesCount; ++i)
+        snprintf (Devices[i].mac, sizeof(Devices[i].mac), "a8bb50%06x", i);
+
+    SimSocket = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (SimSocket < 0) {
+        fprintf (stderr, "cannot open UDP socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    int option = 1;
+    setsockopt (SimSocket, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    setsockopt (SimSocket, SOL_SOCKET, SO_BROADCAST, &option, sizeof(option));
+    setsockopt (SimSocket, IPPROTO_IP, IP_PKTINFO, &option, sizeof(option));
+    option = 4 * 1024 * 1024;
+    setsockopt (SimSocket, SOL_SOCKET, SO_RCVBUF, &option, sizeof(option));
+    setsockopt (SimSocket, SOL_SOCKET, SO_SNDBUF, &option, sizeof(option));
+
+    struct sockaddr_in local;
+    memset (&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(WIZSIM_PORT);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (bind (SimSocket, (struct sockaddr *)(&local), sizeof(local)) < 0) {
+        fprintf (stderr, "cannot bind to UDP port %d: %s\n",
+                 WIZSIM_PORT, strerror(errno));
+        exit(1);
+    }
+    fprintf (stderr, "simulating %d devices from %s\n",
+             DevicesCount, inet_ntoa (*(struct in_addr *)&DevicesBase));
+
+    time_t last = 0;
+    for (;;) {
+        struct pollfd fds = {SimSocket, POLLIN, 0};
+        long long now = wizsim_now();
+        int timeout = 1000 - (int)(now % 1000);
+        if (RepliesCount > 0) {
+            long long wait = Replies[0].due - now;
+            if (wait < 0) wait = 0;
+            if (wait < timeout) timeout = (int)wait;
+        }
+        if (poll (&fds, 1, timeout) > 0) wizsim_receive ();
+
+        now = wizsim_now();
+        while ((RepliesCount > 0) && (Replies[0].due <= now)) {
+            struct SimReply reply = Replies[0];
+            wizsim_dequeue ();
+            wizsim_reply (&reply);
+        }
+        time_t second = time(0);
+        if (second != last) {
+            wizsim_periodic (second);
+            last = second;
+        }
+    }
+}
+